@@ -3,7 +3,8 @@
 ######################################################################
 
 TEMPLATE = subdirs
-SUBDIRS += src
+SUBDIRS += src tests
+CONFIG += ordered
 
 lessThan(QT_MAJOR_VERSION, 5): \
     error(Communi requires Qt 5 but Qt $$[QT_VERSION] was detected.)
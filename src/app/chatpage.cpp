@@ -58,6 +58,8 @@
 
 ChatPage::ChatPage(QWidget* parent) : QSplitter(parent)
 {
+    d.virtualized = false;
+    d.release = 60;
     d.currentBuffer = 0;
     d.finder = new Finder(this);
     d.splitView = new SplitView(this);
@@ -141,6 +143,8 @@ QByteArray ChatPage::saveSettings() const
     QVariantMap settings;
     settings.insert("theme", d.theme.name());
     settings.insert("timestamp", d.timestamp);
+    settings.insert("virtualized", d.virtualized);
+    settings.insert("release", d.release);
     settings.insert("tree", d.treeWidget->saveState());
 
     QByteArray data;
@@ -159,6 +163,12 @@ void ChatPage::restoreSettings(const QByteArray& data)
         d.treeWidget->restoreState(settings.value("tree").toByteArray());
 
     d.timestamp = settings.value("timestamp", "[hh:mm:ss]").toString();
+    d.virtualized = settings.value("virtualized", false).toBool();
+    foreach (BufferView* view, d.splitView->views())
+        view->textBrowser()->setVirtualized(d.virtualized);
+    d.release = settings.value("release", 60).toInt();
+    foreach (TextDocument* doc, d.documents)
+        doc->setReleaseTimeout(d.release * 60000);
     setTheme(settings.value("theme", "Cute").toString());
 }
 
@@ -281,6 +291,15 @@ bool ChatPage::commandFilter(IrcCommand* command)
                 else
                     f.setFamily(value);
                 d.splitView->currentView()->textBrowser()->setFont(f);
+            } else if (!key.compare("virtualized")) {
+                d.virtualized = !value.compare("on", Qt::CaseInsensitive) || !value.compare("true", Qt::CaseInsensitive);
+                foreach (BufferView* view, d.splitView->views())
+                    view->textBrowser()->setVirtualized(d.virtualized);
+            } else if (!key.compare("release")) {
+                // minutes that a hidden buffer keeps its layout, 0 never releases
+                d.release = qMax(0, value.toInt());
+                foreach (TextDocument* doc, d.documents)
+                    doc->setReleaseTimeout(d.release * 60000);
             }
             return true;
         }
@@ -397,6 +416,7 @@ void ChatPage::setupDocument(TextDocument* document)
     d.documents.insert(document);
 
     document->setTimeStampFormat(d.timestamp);
+    document->setReleaseTimeout(d.release * 60000);
     document->setStyleSheet(d.theme.style());
 
     connect(document, SIGNAL(messageReceived(IrcMessage*)), this, SLOT(onMessageReceived(IrcMessage*)));
@@ -416,6 +436,7 @@ void ChatPage::addView(BufferView* view)
 #endif
 
     view->textInput()->setParser(createParser(view));
+    view->textBrowser()->setVirtualized(d.virtualized);
     connect(view, SIGNAL(bufferClosed(IrcBuffer*)), this, SLOT(closeBuffer(IrcBuffer*)));
     connect(view, SIGNAL(cloned(TextDocument*)), this, SLOT(setupDocument(TextDocument*)));
     connect(view, SIGNAL(cloned(TextDocument*)), PluginLoader::instance(), SLOT(documentAdded(TextDocument*)));
@@ -509,8 +530,11 @@ void ChatPage::onSocketError()
             if (buffer) {
                 QStringList params = QStringList() << connection->nickName() << connection->socket()->errorString();
                 IrcMessage* message = IrcMessage::fromParameters(buffer->title(), QString::number(Irc::ERR_UNKNOWNERROR), params, connection);
-                foreach (TextDocument* doc, buffer->findChildren<TextDocument*>())
-                    doc->receiveMessage(message);
+                foreach (TextDocument* doc, buffer->findChildren<TextDocument*>()) {
+                    // clones share the store of the original
+                    if (!doc->isClone())
+                        doc->receiveMessage(message);
+                }
                 delete message;
 
                 TreeItem* item = d.treeWidget->connectionItem(connection);
@@ -531,8 +555,11 @@ void ChatPage::onSecureError()
             if (buffer) {
                 QStringList params = QStringList() << connection->nickName() << tr("Unable to establish secure connection.");
                 IrcMessage* message = IrcMessage::fromParameters(buffer->title(), QString::number(Irc::ERR_UNKNOWNERROR), params, connection);
-                foreach (TextDocument* doc, buffer->findChildren<TextDocument*>())
-                    doc->receiveMessage(message);
+                foreach (TextDocument* doc, buffer->findChildren<TextDocument*>()) {
+                    // clones share the store of the original
+                    if (!doc->isClone())
+                        doc->receiveMessage(message);
+                }
                 delete message;
             }
         }
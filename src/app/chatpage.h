@@ -102,6 +102,8 @@ private:
     static IrcCommandParser* createParser(QObject* parent);
 
     struct Private {
+        bool virtualized;
+        int release;
         Finder* finder;
         ThemeInfo theme;
         QString timestamp;
@@ -28,6 +28,7 @@
 
 #include "themewidget.h"
 #include "textbrowser.h"
+#include "textdocument.h"
 #include "treewidget.h"
 #include "bufferview.h"
 #include "splitview.h"
@@ -167,6 +168,10 @@ void ThemeWidget::updatePreview()
     dpr = devicePixelRatioF();
 #endif
 
+    // render the preview lines only once they are all committed
+    foreach (TextDocument* doc, d.page->findChildren<TextDocument*>())
+        doc->waitForFinished();
+
     QPixmap pixmap(d.page->size() * dpr);
 #if QT_VERSION >= 0x050600
     pixmap.setDevicePixelRatio(dpr);
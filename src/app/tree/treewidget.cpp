@@ -29,6 +29,9 @@
 #include "treewidget.h"
 #include "treedelegate.h"
 #include "textdocument.h"
+#include "messageformatter.h"
+#include "messagestore.h"
+#include "textscheduler.h"
 #include "sharedtimer.h"
 #include "treeitem.h"
 #include "treerole.h"
@@ -351,6 +354,52 @@ QSize TreeWidget::sizeHint() const
     return QSize(w, QTreeWidget::sizeHint().height());
 }
 
+static QString formatBytes(qint64 bytes)
+{
+    if (bytes < 1024 * 1024)
+        return TreeWidget::tr("%1 kB").arg(qMax<qint64>(1, bytes / 1024));
+    return TreeWidget::tr("%1 MB").arg(bytes / (1024.0 * 1024.0), 0, 'f', 1);
+}
+
+static QString formatMemoryUsage(IrcBuffer* buffer)
+{
+    const QList<TextDocument*> documents = buffer ? buffer->findChildren<TextDocument*>() : QList<TextDocument*>();
+    if (documents.isEmpty())
+        return QString();
+
+    // the store and the formatter are shared by all documents of the buffer
+    const QVariantMap store = documents.first()->store()->memoryUsage();
+    const QVariantMap formatter = documents.first()->formatter()->memoryUsage();
+
+    qint64 text = 0;
+    qint64 layout = 0;
+    qint64 other = 0;
+    foreach (TextDocument* doc, documents) {
+        const QVariantMap usage = doc->memoryUsage();
+        text += usage.value("textBytes").toLongLong() + usage.value("blockDataBytes").toLongLong();
+        layout += usage.value("layoutBytes").toLongLong();
+        other += usage.value("queueBytes").toLongLong() + usage.value("highlightBytes").toLongLong() + usage.value("unreadBytes").toLongLong();
+    }
+
+    QStringList lines;
+    lines += TreeWidget::tr("Messages: %1 (%2 in memory, %3 on disk)").arg(formatBytes(store.value("messageBytes").toLongLong()))
+                                                                      .arg(store.value("messages").toInt())
+                                                                      .arg(formatBytes(store.value("diskBytes").toLongLong()));
+    lines += TreeWidget::tr("Raw IRC data: %1").arg(formatBytes(store.value("rawBytes").toLongLong()));
+    lines += TreeWidget::tr("Text: %1, layout: %2").arg(formatBytes(text), formatBytes(layout));
+    lines += TreeWidget::tr("Highlights and queues: %1").arg(formatBytes(other));
+    lines += TreeWidget::tr("Nicks: %1").arg(formatBytes(formatter.value("nameBytes").toLongLong() + formatter.value("userModelBytes").toLongLong()));
+    const QVariantMap scheduler = TextScheduler::instance()->statistics();
+    lines += TreeWidget::tr("Hidden updates: %1 documents, %2 messages queued, flushed in %3 ms (at most %4 ms)")
+                           .arg(scheduler.value("queueDepth").toInt())
+                           .arg(scheduler.value("pendingMessages").toInt())
+                           .arg(scheduler.value("latency").toInt())
+                           .arg(scheduler.value("maximumLatency").toInt());
+    if (!store.value("error").toString().isEmpty())
+        lines += TreeWidget::tr("Scrollback kept in memory: %1").arg(store.value("error").toString());
+    return lines.join("\n");
+}
+
 bool TreeWidget::viewportEvent(QEvent* event)
 {
     if (event->type() == QEvent::ToolTip) {
@@ -368,8 +417,14 @@ bool TreeWidget::viewportEvent(QEvent* event)
 #else
                 QToolTip::showText(he->globalPos(), item->toolTip(0), this, rect);
 #endif
+                return true;
             }
         }
+        if (item) {
+            const QString usage = formatMemoryUsage(item->buffer());
+            if (!usage.isEmpty())
+                QToolTip::showText(he->globalPos(), usage, this, visualItemRect(item));
+        }
         return true;
     }
     return QTreeWidget::viewportEvent(event);
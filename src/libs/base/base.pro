@@ -6,6 +6,7 @@ TEMPLATE = lib
 TARGET = Communi
 CONFIG += communi
 COMMUNI += core model util
+QT += concurrent
 
 DESTDIR = $$BUILD_TREE/lib
 DLLDESTDIR = $$BUILD_TREE/bin
@@ -28,9 +29,13 @@ HEADERS += $$PWD/eventformatter.h
 HEADERS += $$PWD/listview.h
 HEADERS += $$PWD/messagedata.h
 HEADERS += $$PWD/messageformatter.h
+HEADERS += $$PWD/messagestore.h
+HEADERS += $$PWD/messagetemplate.h
+HEADERS += $$PWD/nickmatcher.h
 HEADERS += $$PWD/textbrowser.h
 HEADERS += $$PWD/textdocument.h
 HEADERS += $$PWD/textinput.h
+HEADERS += $$PWD/textscheduler.h
 HEADERS += $$PWD/themeinfo.h
 HEADERS += $$PWD/titlebar.h
 
@@ -39,9 +44,13 @@ SOURCES += $$PWD/eventformatter.cpp
 SOURCES += $$PWD/listview.cpp
 SOURCES += $$PWD/messagedata.cpp
 SOURCES += $$PWD/messageformatter.cpp
+SOURCES += $$PWD/messagestore.cpp
+SOURCES += $$PWD/messagetemplate.cpp
+SOURCES += $$PWD/nickmatcher.cpp
 SOURCES += $$PWD/textbrowser.cpp
 SOURCES += $$PWD/textdocument.cpp
 SOURCES += $$PWD/textinput.cpp
+SOURCES += $$PWD/textscheduler.cpp
 SOURCES += $$PWD/themeinfo.cpp
 SOURCES += $$PWD/titlebar.cpp
 
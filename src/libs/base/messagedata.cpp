@@ -27,12 +27,14 @@
 */
 
 #include "messagedata.h"
+#include <QDataStream>
 
 MessageData::MessageData()
 {
     d.own = false;
     d.error = false;
     d.reply = false;
+    d.highlight = false;
     d.type = IrcMessage::Unknown;
 }
 
@@ -80,12 +82,26 @@ bool MessageData::isError() const
     return d.error || d.type == IrcMessage::Error;
 }
 
+bool MessageData::isHighlight() const
+{
+    return d.highlight;
+}
+
+void MessageData::setHighlight(bool highlight)
+{
+    d.highlight = highlight;
+}
+
 QList<MessageData> MessageData::getEvents() const
 {
-    QList<MessageData> events = d.events;
-    if (events.isEmpty())
-        events += *this;
-    return events;
+    if (d.summary)
+        return d.summary->events;
+    return QList<MessageData>() << *this;
+}
+
+const MessageSummary* MessageData::summary() const
+{
+    return d.summary.data();
 }
 
 bool MessageData::canMerge(const MessageData& other) const
@@ -97,7 +113,30 @@ bool MessageData::canMerge(const MessageData& other) const
 
 void MessageData::merge(const MessageData& other)
 {
-    d.events = other.getEvents() << *this;
+    // the summary of the merged message is extended in place,
+    // the merged message itself is about to be replaced by this one
+    const QList<MessageData> events = getEvents();
+    d.summary = other.d.summary;
+    if (!d.summary) {
+        d.summary = QSharedPointer<MessageSummary>(new MessageSummary);
+        summarize(other);
+    }
+    foreach (const MessageData& event, events)
+        summarize(event);
+}
+
+void MessageData::summarize(const MessageData& event)
+{
+    MessageData copy = event;
+    copy.d.summary.clear();
+    d.summary->events += copy;
+
+    IrcMessage::Type type = event.d.type;
+    if (type == IrcMessage::Quit && event.isError())
+        type = IrcMessage::Error;
+    if (!d.summary->types.contains(type))
+        d.summary->types += type;
+    d.summary->nicks.insert(event.d.nick);
 }
 
 void MessageData::initFrom(IrcMessage* message)
@@ -119,6 +158,17 @@ void MessageData::initFrom(IrcMessage* message)
     }
 }
 
+int MessageData::byteCount() const
+{
+    // approximate, dominated by the strings and the raw line
+    int bytes = sizeof(MessageData) + (d.nick.size() + d.format.size()) * int(sizeof(QChar)) + d.data.size();
+    if (d.summary) {
+        foreach (const MessageData& event, d.summary->events)
+            bytes += event.byteCount();
+    }
+    return bytes;
+}
+
 QString MessageData::format() const
 {
     return d.format;
@@ -148,3 +198,29 @@ IrcMessage::Type MessageData::type() const
 {
     return d.type;
 }
+
+QDataStream& operator<<(QDataStream& out, const MessageData& data)
+{
+    out << data.d.own << data.d.error << data.d.reply << data.d.highlight;
+    out << data.d.nick << data.d.format << data.d.data << data.d.timestamp;
+    out << static_cast<qint32>(data.d.type);
+    out << (data.d.summary ? data.d.summary->events : QList<MessageData>());
+    return out;
+}
+
+QDataStream& operator>>(QDataStream& in, MessageData& data)
+{
+    qint32 type = IrcMessage::Unknown;
+    QList<MessageData> events;
+    in >> data.d.own >> data.d.error >> data.d.reply >> data.d.highlight;
+    in >> data.d.nick >> data.d.format >> data.d.data >> data.d.timestamp;
+    in >> type >> events;
+    data.d.type = static_cast<IrcMessage::Type>(type);
+    data.d.summary.clear();
+    if (!events.isEmpty()) {
+        data.d.summary = QSharedPointer<MessageSummary>(new MessageSummary);
+        foreach (const MessageData& event, events)
+            data.summarize(event);
+    }
+    return in;
+}
@@ -29,12 +29,17 @@
 #ifndef MESSAGEDATA_H
 #define MESSAGEDATA_H
 
+#include <QSet>
 #include <QList>
 #include <QString>
+#include <QSharedPointer>
 #include <QDateTime>
 #include <IrcMessage>
 #include "baseglobal.h"
 
+class QDataStream;
+struct MessageSummary;
+
 class BASE_EXPORT MessageData
 {
 public:
@@ -45,8 +50,12 @@ public:
     bool isEmpty() const;
     bool isEvent() const;
     bool isError() const;
+    bool isHighlight() const;
+    void setHighlight(bool highlight);
+    int byteCount() const;
 
     QList<MessageData> getEvents() const;
+    const MessageSummary* summary() const;
     bool canMerge(const MessageData& other) const;
     void merge(const MessageData& other);
     void initFrom(IrcMessage* message);
@@ -59,18 +68,33 @@ public:
     QDateTime timestamp() const;
     IrcMessage::Type type() const;
 
+    friend BASE_EXPORT QDataStream& operator<<(QDataStream& out, const MessageData& data);
+    friend BASE_EXPORT QDataStream& operator>>(QDataStream& in, MessageData& data);
+
 private:
+    void summarize(const MessageData& event);
+
     struct Private {
         bool own;
         bool error;
         bool reply;
+        bool highlight;
         QString nick;
         QString format;
         QByteArray data;
         QDateTime timestamp;
         IrcMessage::Type type;
-        QList<MessageData> events;
+        QSharedPointer<MessageSummary> summary;
     } d;
 };
 
+// accumulated while events merge, types are listed in order of appearance
+// with IrcMessage::Error standing for disconnects
+struct MessageSummary
+{
+    QList<MessageData> events;
+    QList<IrcMessage::Type> types;
+    QSet<QString> nicks;
+};
+
 #endif // MESSAGEDATA_H
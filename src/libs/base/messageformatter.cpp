@@ -38,37 +38,392 @@
 #include <QTime>
 #include <QColor>
 #include <QCoreApplication>
-#include <QTextBoundaryFinder>
+#include <QCache>
+#include <QPair>
+#include <QVector>
+#include "messagetemplate.h"
+
+// translated templates are compiled once and cached until the language changes
+static QString fill(const char* source, const QString& a1 = QString(), const QString& a2 = QString(),
+                    const QString& a3 = QString(), const QString& a4 = QString())
+{
+    return MessageTemplate::format("MessageFormatter", source, a1, a2, a3, a4);
+}
 
 static QString formatSeconds(int secs)
 {
     const QDateTime time = QDateTime::fromTime_t(secs);
-    return MessageFormatter::tr("%1s").arg(time.secsTo(QDateTime::currentDateTime()));
+    return fill(QT_TRANSLATE_NOOP("MessageFormatter", "%1s"), QString::number(time.secsTo(QDateTime::currentDateTime())));
 }
 
 static QString formatDuration(int secs)
 {
     QStringList idle;
     if (int days = secs / 86400)
-        idle += MessageFormatter::tr("%1 days").arg(days);
+        idle += fill(QT_TRANSLATE_NOOP("MessageFormatter", "%1 days"), QString::number(days));
     secs %= 86400;
     if (int hours = secs / 3600)
-        idle += MessageFormatter::tr("%1 hours").arg(hours);
+        idle += fill(QT_TRANSLATE_NOOP("MessageFormatter", "%1 hours"), QString::number(hours));
     secs %= 3600;
     if (int mins = secs / 60)
-        idle += MessageFormatter::tr("%1 mins").arg(mins);
-    idle += MessageFormatter::tr("%1 secs").arg(secs % 60);
+        idle += fill(QT_TRANSLATE_NOOP("MessageFormatter", "%1 mins"), QString::number(mins));
+    idle += fill(QT_TRANSLATE_NOOP("MessageFormatter", "%1 secs"), QString::number(secs % 60));
     return idle.join(" ");
 }
 
+// noncharacters standing in for deferred message content
+static const ushort placeholder = 0xfdd0;
+
+static QString styleText(const QString& text, MessageFormatter::Style style)
+{
+    QString fmt = text;
+    if (style & MessageFormatter::Bold)
+        fmt = fill(QT_TRANSLATE_NOOP("MessageFormatter", "<b>%1</b>"), fmt);
+    if (style & (MessageFormatter::Color | MessageFormatter::Dim)) {
+        int bucket = (qHash(text) % 9) + 1;
+        if (style & MessageFormatter::Dim) {
+            bucket = 0;
+        }
+        fmt = fill(QT_TRANSLATE_NOOP("MessageFormatter", "<span class='nick%2'>%1</span>"), fmt, QString::number(bucket));
+    }
+    return fmt;
+}
+
+static int channelLength(const QString& text, int pos)
+{
+    int end = pos + 1;
+    const int length = text.length();
+    if (end < length && text.at(end) == '#')
+        ++end;
+    while (end < length) {
+        const QChar c = text.at(end);
+        if (!c.isLetterOrNumber() && (c != '-') && (c != '_'))
+            break;
+        ++end;
+    }
+    return end - pos >= 2 ? end - pos : 0;
+}
+
+static QString formatChannel(const QString& channel)
+{
+    return QString("<a style='text-decoration:none;' href='channel:%1'>%2</a>").arg(channel, styleText(channel, MessageFormatter::Bold | MessageFormatter::Color));
+}
+
+static QString formatNick(const QString& user)
+{
+    return QString("<a style='text-decoration:none;' href='nick:%1'>%2</a>").arg(user, styleText(user, MessageFormatter::Bold | MessageFormatter::Color));
+}
+
+static const char* const defaultColors[] = {
+    "white", "black", "blue", "green", "red", "brown", "purple", "orange",
+    "yellow", "lightgreen", "cyan", "lightcyan", "lightblue", "pink", "gray", "lightgray"
+};
+
+static QString colorName(int color, const IrcPalette* palette)
+{
+    if (palette)
+        return palette->colorName(color, QString());
+    if (color >= 0 && color < 16)
+        return defaultColors[color];
+    return QString();
+}
+
+// reads up to two digits of a mirc color code, or returns -1
+static int parseColor(const QString& text, int* pos)
+{
+    int color = -1;
+    const int length = text.length();
+    for (int i = 0; i < 2 && *pos < length && text.at(*pos).isDigit(); ++i, ++*pos)
+        color = qMax(color, 0) * 10 + text.at(*pos).digitValue();
+    return color;
+}
+
+// skips up to six hex digits of a hex color code
+static bool skipHexColor(const QString& text, int* pos)
+{
+    const int start = *pos;
+    const int length = text.length();
+    while (*pos < length && *pos - start < 6) {
+        const QChar c = text.at(*pos).toLower();
+        if (!c.isDigit() && (c < 'a' || c > 'f'))
+            break;
+        ++*pos;
+    }
+    return *pos > start;
+}
+
+struct TextStyle
+{
+    TextStyle() : color(-1), bold(false), italic(false), underline(false), strikeOut(false) { }
+    int color;
+    bool bold;
+    bool italic;
+    bool underline;
+    bool strikeOut;
+};
+
+static QString styleClasses(const TextStyle& style, const IrcPalette* palette)
+{
+    QStringList classes;
+    if (style.color != -1)
+        classes += colorName(style.color, palette);
+    if (style.bold)
+        classes += "bold";
+    if (style.italic)
+        classes += "italic";
+    if (style.underline)
+        classes += "underline";
+    if (style.strikeOut)
+        classes += "line-through";
+    classes.removeAll(QString());
+    return classes.join(" ");
+}
+
+// the fast path emits class spans named after the default palette, a text
+// format set through setTextFormat() or a customized palette is left to
+// IrcTextFormat
+static bool isDefaultFormat(const IrcTextFormat* format, const QObject* owner)
+{
+    if (format->parent() != owner || format->spanFormat() != IrcTextFormat::SpanClass)
+        return false;
+
+    const IrcPalette* palette = format->palette();
+    for (int i = 0; i < 16; ++i) {
+        if (palette->colorName(i, QString()) != QLatin1String(defaultColors[i]))
+            return false;
+    }
+    return true;
+}
+
+static bool isAddressChar(const QChar& c)
+{
+    const ushort u = c.toLower().unicode();
+    return (u >= 'a' && u <= 'z') || (u >= '0' && u <= '9') || u == '.' || u == '-';
+}
+
+// whether the '@' at pos joins a local part and a dotted domain, the way
+// IrcTextFormat detects e-mail addresses
+static bool isEmail(const QString& text, int pos)
+{
+    if (pos == 0)
+        return false;
+    const QChar prev = text.at(pos - 1);
+    if (!isAddressChar(prev) && prev != '+' && prev != '_')
+        return false;
+
+    const int length = text.length();
+    if (pos + 1 >= length || !isAddressChar(text.at(pos + 1)))
+        return false;
+    for (int i = pos + 2; i + 1 < length && isAddressChar(text.at(i)); ++i) {
+        const ushort next = text.at(i + 1).toLower().unicode();
+        if (text.at(i) == '.' && next >= 'a' && next <= 'z')
+            return true;
+    }
+    return false;
+}
+
+// escapes, styles and links text in one pass, or returns false for
+// possible urls and e-mail addresses that IrcTextFormat has to detect
+static bool formatLine(const QString& text, const NickMatcher& names, const IrcPalette* palette, QString* html)
+{
+    QString msg;
+    msg.reserve(text.length() + text.length() / 4);
+
+    // style changes open a single span lazily before the next visible text
+    TextStyle style;
+    bool changed = false;
+    bool open = false;
+
+    const int length = text.length();
+    int pos = 0;
+    while (pos < length) {
+        const QChar c = text.at(pos);
+        const ushort u = c.unicode();
+        if (u < 0x20 && u != '\t') {
+            ++pos;
+            switch (u) {
+                case '\x02':
+                    style.bold = !style.bold;
+                    break;
+                case '\x1d':
+                    style.italic = !style.italic;
+                    break;
+                case '\x1f':
+                    style.underline = !style.underline;
+                    break;
+                case '\x1e':
+                    style.strikeOut = !style.strikeOut;
+                    break;
+                case '\x0f':
+                    style = TextStyle();
+                    break;
+                case '\x03': {
+                    const int color = parseColor(text, &pos);
+                    if (color != -1 && pos + 1 < length && text.at(pos) == ',' && text.at(pos + 1).isDigit()) {
+                        ++pos;
+                        parseColor(text, &pos); // backgrounds are not themed
+                    }
+                    style.color = color;
+                    break;
+                }
+                case '\x04':
+                    // hex colors cannot be mapped to theme classes
+                    if (skipHexColor(text, &pos) && pos + 1 < length && text.at(pos) == ',') {
+                        ++pos;
+                        skipHexColor(text, &pos);
+                    }
+                    break;
+                default:
+                    // reverse, monospace and unknown codes are dropped
+                    break;
+            }
+            changed = true;
+            continue;
+        }
+
+        if (changed) {
+            if (open)
+                msg += "</span>";
+            const QString classes = styleClasses(style, palette);
+            open = !classes.isEmpty();
+            if (open)
+                msg += "<span class='" + classes + "'>";
+            changed = false;
+        }
+
+        switch (u) {
+            case '&':
+                msg += "&amp;";
+                ++pos;
+                continue;
+            case '<':
+                msg += "&lt;";
+                ++pos;
+                continue;
+            case '>':
+                msg += "&gt;";
+                ++pos;
+                continue;
+            case '"':
+                msg += "&quot;";
+                ++pos;
+                continue;
+            case '@':
+                if (isEmail(text, pos))
+                    return false;
+                break;
+            case ':':
+                if (text.midRef(pos, 3) == "://")
+                    return false;
+                break;
+            case 'w':
+            case 'W':
+                if (text.midRef(pos, 4).compare(QString("www."), Qt::CaseInsensitive) == 0)
+                    return false;
+                break;
+            case '#':
+                if (!names.isEmpty()) {
+                    if (int n = channelLength(text, pos)) {
+                        msg += formatChannel(text.mid(pos, n));
+                        pos += n;
+                        continue;
+                    }
+                }
+                break;
+            default:
+                break;
+        }
+
+        if (!names.isEmpty()) {
+            if (int n = names.match(text, pos)) {
+                msg += formatNick(text.mid(pos, n));
+                pos += n;
+                continue;
+            }
+        }
+        msg += c;
+        ++pos;
+    }
+    if (open)
+        msg += "</span>";
+    *html = msg;
+    return true;
+}
+
+static QString formatNames(const QString& html, const NickMatcher& names)
+{
+    if (names.isEmpty())
+        return html;
+
+    // a single pass that copies tags, entities and existing links as is
+    QString msg;
+    msg.reserve(html.length());
+    const int length = html.length();
+    int pos = 0;
+    while (pos < length) {
+        const QChar c = html.at(pos);
+        int end = -1;
+        if (c == '<') {
+            if (html.midRef(pos, 3) == "<a ") {
+                end = html.indexOf("</a>", pos + 3);
+                if (end != -1)
+                    end += 4;
+            }
+            if (end == -1) {
+                end = html.indexOf('>', pos);
+                if (end != -1)
+                    ++end;
+            }
+        } else if (c == '&') {
+            end = html.indexOf(';', pos);
+            if (end != -1)
+                ++end;
+        } else if (c == '#') {
+            if (int n = channelLength(html, pos)) {
+                msg += formatChannel(html.mid(pos, n));
+                pos += n;
+                continue;
+            }
+        } else if (int n = names.match(html, pos)) {
+            msg += formatNick(html.mid(pos, n));
+            pos += n;
+            continue;
+        }
+
+        if (end != -1) {
+            msg += html.midRef(pos, end - pos);
+            pos = end;
+        } else {
+            msg += c;
+            ++pos;
+        }
+    }
+    return msg;
+}
+
+// styled nick fragments shared by the formatters of a connection
+class StyleCache : public QObject
+{
+public:
+    StyleCache(QObject* parent) : QObject(parent), generation(MessageTemplate::cacheGeneration()), fragments(512)
+    {
+        setObjectName(name());
+    }
+
+    static const char* name() { return "__communi_style_cache"; }
+
+    int generation;
+    QCache<QPair<QString, int>, QString> fragments;
+};
+
 MessageFormatter::MessageFormatter(QObject* parent) : QObject(parent)
 {
     d.buffer = 0;
+    d.texts = 0;
     d.textFormat = new IrcTextFormat(this);
     d.textFormat->setSpanFormat(IrcTextFormat::SpanClass);
 
-    d.userModel = new IrcUserModel(this);
-    connect(d.userModel, SIGNAL(namesChanged(QStringList)), this, SLOT(indexNames(QStringList)));
+    d.userModel = 0;
 }
 
 IrcBuffer* MessageFormatter::buffer() const
@@ -80,7 +435,24 @@ void MessageFormatter::setBuffer(IrcBuffer* buffer)
 {
     if (d.buffer != buffer) {
         d.buffer = buffer;
-        d.userModel->setChannel(qobject_cast<IrcChannel*>(buffer));
+        IrcChannel* channel = qobject_cast<IrcChannel*>(buffer);
+        if (channel && !d.userModel) {
+            d.userModel = new IrcUserModel(this);
+            connect(d.userModel, SIGNAL(namesChanged(QStringList)), this, SLOT(indexNames(QStringList)));
+        }
+        if (d.userModel)
+            d.userModel->setChannel(channel);
+
+        IrcConnection* connection = buffer ? buffer->connection() : 0;
+        d.styles = 0;
+        if (connection) {
+            connect(connection, SIGNAL(numericMessageReceived(IrcNumericMessage*)), this, SLOT(updateCaseMapping(IrcNumericMessage*)), Qt::UniqueConnection);
+            d.names.setCaseMapping(NickMatcher::caseMapping(connection->property("caseMapping").toString()));
+
+            d.styles = static_cast<StyleCache*>(connection->findChild<QObject*>(StyleCache::name(), Qt::FindDirectChildrenOnly));
+            if (!d.styles)
+                d.styles = new StyleCache(connection);
+        }
     }
 }
 
@@ -166,143 +538,323 @@ MessageData MessageFormatter::formatMessage(IrcMessage* msg)
 
 QString MessageFormatter::formatText(const QString& text) const
 {
+    if (d.texts && d.texts->count() < 32) {
+        // substituted by finishMessage(), possibly in another thread
+        d.texts->append(text);
+        return QString(QChar(placeholder + d.texts->count() - 1));
+    }
+
+    QString html;
+    if (isDefaultFormat(d.textFormat, this) && formatLine(text, d.names, d.textFormat->palette(), &html))
+        return html;
+
     d.textFormat->parse(text);
+    return formatNames(d.textFormat->html(), d.names);
+}
 
-    QString msg = d.textFormat->html();
-    if (!d.names.isEmpty()) {
-        QTextBoundaryFinder finder = QTextBoundaryFinder(QTextBoundaryFinder::Word, msg);
-        int pos = 0;
-        while (pos < msg.length()) {
-            const QChar c = msg.at(pos);
-            if (!c.isSpace()) {
-                // do not format nicks within links
-                if (c == '<' && msg.midRef(pos, 3) == "<a ") {
-                    const int end = msg.indexOf("</a>", pos + 3);
-                    if (end != -1) {
-                        pos = end + 4;
-                        continue;
-                    }
-                } else if (c == '#') {
-                    int end = pos + 1;
-                    const int length = msg.length();
-                    if (end < length && msg.at(end) == '#')
-                        ++end;
-                    while (end < length) {
-                        const QChar nextChar = msg.at(end);
-                        if (!nextChar.isLetterOrNumber() && (nextChar != '-') && (nextChar != '_'))
-                            break;
-                        ++end;
-                    }
-                    if (end - pos < 2) {
-                        ++pos;
-                        continue;
-                    }
+QString MessageFormatter::formatText(const QString& text, const NickMatcher& names)
+{
+    QString html;
+    if (formatLine(text, names, 0, &html))
+        return html;
+
+    IrcTextFormat format;
+    format.setSpanFormat(IrcTextFormat::SpanClass);
+    format.parse(text);
+    return formatNames(format.html(), names);
+}
 
-                    const QString channel = msg.mid(pos, end - pos);
+MessageData MessageFormatter::prepareMessage(IrcMessage* msg, QStringList* texts)
+{
+    // only the content of messages and notices, parsed with the default text format, is deferred
+    const IrcMessage::Type type = MessageData::effectiveType(msg);
+    if ((type == IrcMessage::Private || type == IrcMessage::Notice) && isDefaultFormat(d.textFormat, this))
+        d.texts = texts;
+
+    MessageData data = formatMessage(msg);
+    d.texts = 0;
+
+    // the placeholders are noncharacters, which may still arrive in raw text;
+    // the content is formatted right away unless each one occurs exactly once
+    if (!texts->isEmpty()) {
+        QVector<int> counts(texts->count());
+        foreach (const QChar& c, data.format()) {
+            const int index = c.unicode() - placeholder;
+            if (index >= 0 && index < counts.count())
+                ++counts[index];
+        }
+        if (counts.count(1) != counts.count()) {
+            texts->clear();
+            data = formatMessage(msg);
+        }
+    }
+    return data;
+}
 
-                    const QString formatted = QString("<a style='text-decoration:none;' href='channel:%1'>%2</a>").arg(channel, styledText(channel, Bold | Color));
-                    msg.replace(pos, channel.length(), formatted);
-                    pos += formatted.length();
-                    continue;
-                }
-                // test word start boundary
-                finder.setPosition(pos);
-                if (finder.isAtBoundary()) {
-                    QMultiHash<QChar, QString>::const_iterator it = d.names.find(c);
-                    while (it != d.names.constEnd() && it.key() == c) {
-                        const QString& user = it.value();
-                        if (msg.midRef(pos, user.length()) == user) {
-                            // test word end boundary
-                            finder.setPosition(pos + user.length());
-                            if (finder.isAtBoundary()) {
-                                const QString formatted = QString("<a style='text-decoration:none;' href='nick:%1'>%2</a>").arg(user, styledText(user, Bold | Color));
-                                msg.replace(pos, user.length(), formatted);
-                                pos += formatted.length();
-                                finder = QTextBoundaryFinder(QTextBoundaryFinder::Word, msg);
-                            }
-                        }
-                        ++it;
-                    }
+MessageData MessageFormatter::finishMessage(const MessageData& data, const QStringList& texts, const NickMatcher& names)
+{
+    const QString format = data.format();
+    QString result;
+    result.reserve(format.length());
+    foreach (const QChar& c, format) {
+        const int index = c.unicode() - placeholder;
+        if (index >= 0 && index < texts.count())
+            result += formatText(texts.at(index), names);
+        else
+            result += c;
+    }
+
+    MessageData message = data;
+    message.setFormat(result);
+    return message;
+}
+
+NickMatcher MessageFormatter::names() const
+{
+    return d.names;
+}
+
+void MessageFormatter::setNames(const NickMatcher& names)
+{
+    d.names = names;
+}
+
+QVariantMap MessageFormatter::memoryUsage() const
+{
+    // the nick matcher, and the rows of the user model
+    const int users = d.userModel ? d.userModel->count() : 0;
+
+    QVariantMap usage;
+    usage.insert("names", d.names.count());
+    usage.insert("nameBytes", d.names.byteCount());
+    usage.insert("users", users);
+    usage.insert("userModelBytes", qint64(users) * 2 * sizeof(void*));
+    return usage;
+}
+
+static bool parseEntity(const QString& entity, QString* text)
+{
+    if (entity == "amp")
+        *text += '&';
+    else if (entity == "lt")
+        *text += '<';
+    else if (entity == "gt")
+        *text += '>';
+    else if (entity == "quot")
+        *text += '"';
+    else if (entity == "apos")
+        *text += '\'';
+    else if (entity == "nbsp")
+        *text += QChar(QChar::Nbsp);
+    else if (entity.startsWith('#')) {
+        bool ok = false;
+        const uint code = entity.startsWith("#x", Qt::CaseInsensitive) ? entity.mid(2).toUInt(&ok, 16) : entity.mid(1).toUInt(&ok);
+        if (!ok || code == 0 || code > 0xffff)
+            return false;
+        *text += QChar(code);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool parseTag(const QString& tag, QString* name, QString* style, QString* href)
+{
+    static const QStringList tags = QStringList() << "span" << "a" << "b" << "i" << "u" << "s" << "em" << "strong";
+
+    const int length = tag.length();
+    int pos = 0;
+    while (pos < length && tag.at(pos).isLetter())
+        ++pos;
+    *name = tag.left(pos).toLower();
+    if (!tags.contains(*name))
+        return false;
+
+    // the style of a tag is its attributes, only hrefs vary from run to run
+    *style = *name;
+    while (pos < length) {
+        while (pos < length && tag.at(pos).isSpace())
+            ++pos;
+        if (pos == length)
+            break;
+        const int eq = tag.indexOf('=', pos);
+        if (eq == -1 || eq + 1 >= length)
+            return false;
+        const QChar quote = tag.at(eq + 1);
+        if (quote != '\'' && quote != '"')
+            return false;
+        const int end = tag.indexOf(quote, eq + 2);
+        if (end == -1)
+            return false;
+        const QString attribute = tag.mid(pos, eq - pos).trimmed().toLower();
+        const QString value = tag.mid(eq + 2, end - eq - 2);
+        if (value.contains(quote == '"' ? '\'' : '"'))
+            return false;
+        if (attribute == "href") {
+            int index = 0;
+            while (index < value.length()) {
+                if (value.at(index) == '&') {
+                    const int semicolon = value.indexOf(';', index);
+                    if (semicolon == -1 || !parseEntity(value.mid(index + 1, semicolon - index - 1), href))
+                        return false;
+                    index = semicolon + 1;
+                } else {
+                    *href += value.at(index++);
                 }
             }
+            *style += " href='#'";
+        } else if (value.contains('&')) {
+            return false;
+        } else {
+            *style += QString(" %1='%2'").arg(attribute, value);
+        }
+        pos = end + 1;
+    }
+    return true;
+}
+
+bool MessageFormatter::formatRuns(const QString& html, QList<Run>* runs)
+{
+    // a run list for the inline markup of the formatter, anything
+    // beyond that is left to the full html parser of QTextDocument
+    QList<Run> result;
+    QStringList tags;
+    QStringList hrefs;
+    Run run;
+
+    const int length = html.length();
+    int pos = 0;
+    while (pos < length) {
+        const QChar c = html.at(pos);
+        if (c == '<' || c == '&') {
+            const int end = html.indexOf(c == '<' ? '>' : ';', pos);
+            if (end == -1)
+                return false;
+            const QString token = html.mid(pos + 1, end - pos - 1);
+            pos = end + 1;
+
+            if (c == '&') {
+                if (!parseEntity(token, &run.text))
+                    return false;
+                continue;
+            }
+
+            if (!run.text.isEmpty()) {
+                result += run;
+                run.text.clear();
+            }
+
+            if (token.startsWith('/')) {
+                if (tags.isEmpty() || tags.last() != token.mid(1).trimmed().toLower())
+                    return false;
+                tags.removeLast();
+                run.styles.removeLast();
+                run.href = hrefs.takeLast();
+            } else {
+                QString name, style, href;
+                if (!parseTag(token, &name, &style, &href))
+                    return false;
+                tags += name;
+                run.styles += style;
+                hrefs += run.href;
+                if (!href.isEmpty())
+                    run.href = href;
+            }
+        } else if (c == '>' || c == '\n' || c == '\r' || c == '\t') {
+            return false;
+        } else {
+            run.text += c;
             ++pos;
         }
     }
-    return msg;
+    if (!tags.isEmpty())
+        return false;
+    if (!run.text.isEmpty())
+        result += run;
+
+    *runs = result;
+    return true;
 }
 
 QString MessageFormatter::formatExpander(const QString& expander) const
 {
-    return tr("<a href='expand:' class='event' style='text-decoration:none;'>%1</a>").arg(expander);
+    return fill(QT_TR_NOOP("<a href='expand:' class='event' style='text-decoration:none;'>%1</a>"), expander);
 }
 
 QString MessageFormatter::styledText(const QString& text, Style style) const
 {
-    QString fmt = text;
-    if (style & Bold)
-        fmt = tr("<b>%1</b>").arg(fmt);
-    if (style & (Color | Dim)) {
-        int bucket = (qHash(text) % 9) + 1;
-        if (style & Dim) {
-            bucket = 0;
-        }
-        fmt = tr("<span class='nick%2'>%1</span>").arg(fmt, QString::number(bucket));
+    StyleCache* cache = d.styles;
+    if (!cache)
+        return styleText(text, style);
+
+    // fragments refer to theme colors by class, so only a language change makes them stale
+    const int generation = MessageTemplate::cacheGeneration();
+    if (cache->generation != generation) {
+        cache->fragments.clear();
+        cache->generation = generation;
     }
-    return fmt;
+
+    const QPair<QString, int> key(text, style);
+    if (QString* fragment = cache->fragments.object(key))
+        return *fragment;
+
+    const QString fragment = styleText(text, style);
+    cache->fragments.insert(key, new QString(fragment));
+    return fragment;
 }
 
 QString MessageFormatter::formatAwayMessage(IrcAwayMessage* msg)
 {
     if (msg->isOwn())
-        return tr("! %1").arg(formatText(msg->content()));
+        return fill(QT_TR_NOOP("! %1"), formatText(msg->content()));
     else if (!msg->content().isEmpty())
-        return tr("! %1 is away (%2)").arg(formatSender(msg),
-                                           formatText(msg->content()));
-    return tr("! %1 is back").arg(formatSender(msg));
+        return fill(QT_TR_NOOP("! %1 is away (%2)"), formatSender(msg),
+                                                     formatText(msg->content()));
+    return fill(QT_TR_NOOP("! %1 is back"), formatSender(msg));
 }
 
 QString MessageFormatter::formatInviteMessage(IrcInviteMessage* msg)
 {
     if (msg->isReply())
-        return tr("! invited %1 to %2").arg(styledText(msg->user(), Bold),
-                                            styledText(msg->channel(), Bold));
+        return fill(QT_TR_NOOP("! invited %1 to %2"), styledText(msg->user(), Bold),
+                                                      styledText(msg->channel(), Bold));
 
-    return tr("%1 %2 invited to %3").arg(formatExpander("!"),
-                                         formatSender(msg),
-                                         styledText(msg->channel(), Bold));
+    return fill(QT_TR_NOOP("%1 %2 invited to %3"), formatExpander("!"),
+                                                   formatSender(msg),
+                                                   styledText(msg->channel(), Bold));
 }
 
 QString MessageFormatter::formatJoinMessage(IrcJoinMessage* msg)
 {
-    return tr("%1 %2 joined").arg(formatExpander("!"),
-                                  formatSender(msg));
+    return fill(QT_TR_NOOP("%1 %2 joined"), formatExpander("!"),
+                                            formatSender(msg));
 }
 
 QString MessageFormatter::formatKickMessage(IrcKickMessage* msg)
 {
-    return tr("%1 %2 kicked %3").arg(formatExpander("!"),
-                                     formatSender(msg),
-                                     styledText(msg->user(), Bold));
+    return fill(QT_TR_NOOP("%1 %2 kicked %3"), formatExpander("!"),
+                                               formatSender(msg),
+                                               styledText(msg->user(), Bold));
 }
 
 QString MessageFormatter::formatModeMessage(IrcModeMessage* msg)
 {
     if (msg->isReply())
-        return tr("%1 %2 mode is %3 %4").arg(formatExpander("!"),
-                                             styledText(msg->target(), Bold),
-                                             styledText(msg->mode(), Bold),
-                                             styledText(msg->argument(), Bold));
-
-    return tr("%1 %2 sets mode %3 %4").arg(formatExpander("!"),
-                                           formatSender(msg),
-                                           styledText(msg->mode(), Bold),
-                                           styledText(msg->argument(), Bold));
+        return fill(QT_TR_NOOP("%1 %2 mode is %3 %4"), formatExpander("!"),
+                                                       styledText(msg->target(), Bold),
+                                                       styledText(msg->mode(), Bold),
+                                                       styledText(msg->argument(), Bold));
+
+    return fill(QT_TR_NOOP("%1 %2 sets mode %3 %4"), formatExpander("!"),
+                                                     formatSender(msg),
+                                                     styledText(msg->mode(), Bold),
+                                                     styledText(msg->argument(), Bold));
 }
 
 QString MessageFormatter::formatMotdMessage(IrcMotdMessage *msg)
 {
     foreach (const QString& line, msg->lines()) {
-        MessageData data = formatClass(tr("[MOTD] %1").arg(formatText(line)), msg);
+        MessageData data = formatClass(fill(QT_TR_NOOP("[MOTD] %1"), formatText(line)), msg);
         emit formatted(data);
     }
     return QString();
@@ -319,7 +871,7 @@ QString MessageFormatter::formatNamesMessage(IrcNamesMessage* msg)
         QStringList titles = userModel.titles();
         for (int i = 0; i < titles.count(); i += 10) {
             QStringList row = titles.mid(i, 10);
-            MessageData data = formatClass(tr("[NAMES] %1").arg(row.join(tr(" "))), msg);
+            MessageData data = formatClass(fill(QT_TR_NOOP("[NAMES] %1"), row.join(tr(" "))), msg);
             emit formatted(data);
         }
     }
@@ -329,8 +881,8 @@ QString MessageFormatter::formatNamesMessage(IrcNamesMessage* msg)
 
 QString MessageFormatter::formatNickMessage(IrcNickMessage* msg)
 {
-    return tr("%1 %2 changed nick").arg(formatExpander("!"),
-                                        styledText(msg->newNick(), Bold));
+    return fill(QT_TR_NOOP("%1 %2 changed nick"), formatExpander("!"),
+                                                  styledText(msg->newNick(), Bold));
 }
 
 QString MessageFormatter::formatNoticeMessage(IrcNoticeMessage* msg)
@@ -340,13 +892,13 @@ QString MessageFormatter::formatNoticeMessage(IrcNoticeMessage* msg)
         const QString cmd = params.value(0);
         if (cmd.toUpper() == "PING") {
             const QString secs = formatSeconds(params.value(1).toInt());
-            return tr("! %1 replied in %2").arg(formatSender(msg), secs);
+            return fill(QT_TR_NOOP("! %1 replied in %2"), formatSender(msg), secs);
         } else if (cmd.toUpper() == "TIME") {
             const QString rest = QStringList(params.mid(1)).join(" ");
-            return tr("! %1 time is %2").arg(formatSender(msg), rest);
+            return fill(QT_TR_NOOP("! %1 time is %2"), formatSender(msg), rest);
         } else if (cmd.toUpper() == "VERSION") {
             const QString rest = QStringList(params.mid(1)).join(" ");
-            return tr("! %1 version is %2").arg(formatSender(msg), rest);
+            return fill(QT_TR_NOOP("! %1 version is %2"), formatSender(msg), rest);
         }
     }
 
@@ -355,14 +907,14 @@ QString MessageFormatter::formatNoticeMessage(IrcNoticeMessage* msg)
         pfx = styledText(":" + pfx, Dim);
 
     if (msg->isPrivate())
-        return tr("[%1%2] %3").arg(formatSender(msg),
-                                   pfx,
-                                   formatText(msg->content()));
-
-    return tr("&lt;%1%2&gt; [%3] %4").arg(formatSender(msg),
-                                          pfx,
-                                          msg->target(),
-                                          formatText(msg->content()));
+        return fill(QT_TR_NOOP("[%1%2] %3"), formatSender(msg),
+                                             pfx,
+                                             formatText(msg->content()));
+
+    return fill(QT_TR_NOOP("&lt;%1%2&gt; [%3] %4"), formatSender(msg),
+                                                    pfx,
+                                                    msg->target(),
+                                                    formatText(msg->content()));
 }
 
 #define P_(x) msg->parameters().value(x)
@@ -371,14 +923,14 @@ QString MessageFormatter::formatNoticeMessage(IrcNoticeMessage* msg)
 QString MessageFormatter::formatNumericMessage(IrcNumericMessage* msg)
 {
     if (msg->code() < 300)
-        return tr("[INFO] %1").arg(formatText(MID_(1)));
+        return fill(QT_TR_NOOP("[INFO] %1"), formatText(MID_(1)));
 
     switch (msg->code()) {
         case Irc::RPL_VERSION: // TODO: IrcVersionMessage?
-            return tr("! %1 version is %2").arg(styledText(msg->nick(), Bold), P_(1));
+            return fill(QT_TR_NOOP("! %1 version is %2"), styledText(msg->nick(), Bold), P_(1));
 
         case Irc::RPL_TIME: // TODO: IrcTimeMessage?
-            return tr("! %1 time is %2").arg(styledText(P_(1), Bold), P_(2));
+            return fill(QT_TR_NOOP("! %1 time is %2"), styledText(P_(1), Bold), P_(2));
 
         default:
             break;
@@ -389,51 +941,51 @@ QString MessageFormatter::formatNumericMessage(IrcNumericMessage* msg)
 
     // if you change this, change formatErrorMessage too
     if (Irc::codeToString(msg->code()).startsWith("ERR_"))
-        return tr("[ERROR] %1").arg(formatText(MID_(1)));
+        return fill(QT_TR_NOOP("[ERROR] %1"), formatText(MID_(1)));
 
     if (msg->code() == Irc::RPL_CHANNEL_URL)
-        return tr("[Channel URL] %1").arg(d.textFormat->toHtml(MID_(1)));
+        return fill(QT_TR_NOOP("[Channel URL] %1"), d.textFormat->toHtml(MID_(1)));
 
-    return tr("[%1] %2").arg(msg->code()).arg(d.textFormat->toHtml(MID_(1)));
+    return fill(QT_TR_NOOP("[%1] %2"), QString::number(msg->code()), d.textFormat->toHtml(MID_(1)));
 }
 
 QString MessageFormatter::formatErrorMessage(IrcErrorMessage* msg)
 {
     // if you change this, change ERR_ in formatNumericMessage too
-    return tr("[ERROR] %1").arg(msg->error());
+    return fill(QT_TR_NOOP("[ERROR] %1"), msg->error());
 }
 
 QString MessageFormatter::formatPartMessage(IrcPartMessage* msg)
 {
-    return tr("%1 %2 left").arg(formatExpander("!"),
-                                formatSender(msg));
+    return fill(QT_TR_NOOP("%1 %2 left"), formatExpander("!"),
+                                          formatSender(msg));
 }
 
 QString MessageFormatter::formatPongMessage(IrcPongMessage* msg)
 {
     const QString secs = formatSeconds(msg->argument().toInt());
-    return tr("! %1 replied in %2").arg(formatSender(msg), secs);
+    return fill(QT_TR_NOOP("! %1 replied in %2"), formatSender(msg), secs);
 }
 
 QString MessageFormatter::formatPrivateMessage(IrcPrivateMessage* msg)
 {
     if (msg->isRequest())
-        return tr("%1 %2 requested %3").arg(formatExpander("!"),
-                                            formatSender(msg),
-                                            msg->content().split(" ").value(0).toUpper());
+        return fill(QT_TR_NOOP("%1 %2 requested %3"), formatExpander("!"),
+                                                      formatSender(msg),
+                                                      msg->content().split(" ").value(0).toUpper());
 
     if (msg->isAction())
-        return tr("* %1 %2").arg(formatSender(msg),
-                                 formatText(msg->content()));
+        return fill(QT_TR_NOOP("* %1 %2"), formatSender(msg),
+                                           formatText(msg->content()));
 
     QString pfx = msg->statusPrefix();
     if (!pfx.isEmpty())
         pfx = styledText(":" + pfx, Dim);
 
-    return tr("&lt;<a style='text-decoration:none;' href='nick:%1'>%2</a>%3&gt; %4").arg(msg->nick(),
-                                                                                         formatSender(msg),
-                                                                                         pfx,
-                                                                                         formatText(msg->content()));
+    return fill(QT_TR_NOOP("&lt;<a style='text-decoration:none;' href='nick:%1'>%2</a>%3&gt; %4"), msg->nick(),
+                                                                                                   formatSender(msg),
+                                                                                                   pfx,
+                                                                                                   formatText(msg->content()));
 }
 
 QString MessageFormatter::formatQuitMessage(IrcQuitMessage* msg)
@@ -442,11 +994,11 @@ QString MessageFormatter::formatQuitMessage(IrcQuitMessage* msg)
     if (reason.contains("Ping timeout")
             || reason.contains("Connection reset by peer")
             || reason.contains("Remote host closed the connection")) {
-        return tr("%1 %2 disconnected").arg(formatExpander("!"),
-                                            formatSender(msg));
+        return fill(QT_TR_NOOP("%1 %2 disconnected"), formatExpander("!"),
+                                                      formatSender(msg));
     }
-    return tr("%1 %2 quit").arg(formatExpander("!"),
-                                formatSender(msg));
+    return fill(QT_TR_NOOP("%1 %2 quit"), formatExpander("!"),
+                                          formatSender(msg));
 }
 
 QString MessageFormatter::formatTopicMessage(IrcTopicMessage* msg)
@@ -457,55 +1009,55 @@ QString MessageFormatter::formatTopicMessage(IrcTopicMessage* msg)
     if (msg->isReply()) {
         if (msg->topic().isEmpty())
             return tr("! no topic");
-        return tr("[TOPIC] %1").arg(formatText(msg->topic()));
+        return fill(QT_TR_NOOP("[TOPIC] %1"), formatText(msg->topic()));
     }
 
     if (msg->topic().isEmpty())
-        return tr("%1 %2 cleared topic").arg(formatExpander("!"),
-                                             formatSender(msg));
+        return fill(QT_TR_NOOP("%1 %2 cleared topic"), formatExpander("!"),
+                                                       formatSender(msg));
 
-    return tr("%1 %2 changed topic").arg(formatExpander("!"),
-                                         formatSender(msg));
+    return fill(QT_TR_NOOP("%1 %2 changed topic"), formatExpander("!"),
+                                                   formatSender(msg));
 }
 
 QString MessageFormatter::formatUnknownMessage(IrcMessage* msg)
 {
-    return tr("%1 %2 %3 %4").arg(formatExpander("?"),
-                                 formatSender(msg),
-                                 msg->command(),
-                                 msg->parameters().join(" "));
+    return fill(QT_TR_NOOP("%1 %2 %3 %4"), formatExpander("?"),
+                                           formatSender(msg),
+                                           msg->command(),
+                                           msg->parameters().join(" "));
 }
 
 QString MessageFormatter::formatWhoisMessage(IrcWhoisMessage* msg)
 {
-    emit formatted(formatClass(tr("[WHOIS] %1 is %2@%3 (%4)").arg(msg->nick(), msg->ident(), msg->host(), formatText(msg->realName())), msg));
-    emit formatted(formatClass(tr("[WHOIS] %1 is connected via %2 (%3)").arg(msg->nick(), msg->server(), msg->info()), msg));
-    emit formatted(formatClass(tr("[WHOIS] %1 is connected since %2 (idle %3)").arg(msg->nick(), msg->since().toString(), formatDuration(msg->idle())), msg));
+    emit formatted(formatClass(fill(QT_TR_NOOP("[WHOIS] %1 is %2@%3 (%4)"), msg->nick(), msg->ident(), msg->host(), formatText(msg->realName())), msg));
+    emit formatted(formatClass(fill(QT_TR_NOOP("[WHOIS] %1 is connected via %2 (%3)"), msg->nick(), msg->server(), msg->info()), msg));
+    emit formatted(formatClass(fill(QT_TR_NOOP("[WHOIS] %1 is connected since %2 (idle %3)"), msg->nick(), msg->since().toString(), formatDuration(msg->idle())), msg));
     if (!msg->awayReason().isEmpty())
-        emit formatted(formatClass(tr("[WHOIS] %1 is away: %2").arg(msg->nick(), msg->awayReason()), msg));
+        emit formatted(formatClass(fill(QT_TR_NOOP("[WHOIS] %1 is away: %2"), msg->nick(), msg->awayReason()), msg));
     if (!msg->account().isEmpty())
-        emit formatted(formatClass(tr("[WHOIS] %1 is logged in as %2").arg(msg->nick(), msg->account()), msg));
+        emit formatted(formatClass(fill(QT_TR_NOOP("[WHOIS] %1 is logged in as %2"), msg->nick(), msg->account()), msg));
     if (!msg->address().isEmpty())
-        emit formatted(formatClass(tr("[WHOIS] %1 is connected from %2").arg(msg->nick(), msg->address()), msg));
+        emit formatted(formatClass(fill(QT_TR_NOOP("[WHOIS] %1 is connected from %2"), msg->nick(), msg->address()), msg));
     if (msg->isSecure())
-        emit formatted(formatClass(tr("[WHOIS] %1 is using a secure connection").arg(msg->nick()), msg));
+        emit formatted(formatClass(fill(QT_TR_NOOP("[WHOIS] %1 is using a secure connection"), msg->nick()), msg));
     if (!msg->channels().isEmpty())
-        emit formatted(formatClass(tr("[WHOIS] %1 is on %2").arg(msg->nick(), msg->channels().join(" ")), msg));
+        emit formatted(formatClass(fill(QT_TR_NOOP("[WHOIS] %1 is on %2"), msg->nick(), msg->channels().join(" ")), msg));
     return QString();
 }
 
 QString MessageFormatter::formatWhowasMessage(IrcWhowasMessage* msg)
 {
-    emit formatted(formatClass(tr("[WHOWAS] %1 was %2@%3 (%4)").arg(msg->nick(), msg->ident(), msg->host(), formatText(msg->realName())), msg));
-    emit formatted(formatClass(tr("[WHOWAS] %1 was connected via %2 (%3)").arg(msg->nick(), msg->server(), msg->info()), msg));
+    emit formatted(formatClass(fill(QT_TR_NOOP("[WHOWAS] %1 was %2@%3 (%4)"), msg->nick(), msg->ident(), msg->host(), formatText(msg->realName())), msg));
+    emit formatted(formatClass(fill(QT_TR_NOOP("[WHOWAS] %1 was connected via %2 (%3)"), msg->nick(), msg->server(), msg->info()), msg));
     if (!msg->account().isEmpty())
-        emit formatted(formatClass(tr("[WHOWAS] %1 was logged in as %2").arg(msg->nick(), msg->account()), msg));
+        emit formatted(formatClass(fill(QT_TR_NOOP("[WHOWAS] %1 was logged in as %2"), msg->nick(), msg->account()), msg));
     return QString();
 }
 
 QString MessageFormatter::formatWhoReplyMessage(IrcWhoReplyMessage* msg)
 {
-    QString format = tr("[WHO] %1 (%2)").arg(formatSender(msg), msg->realName());
+    QString format = fill(QT_TR_NOOP("[WHO] %1 (%2)"), formatSender(msg), msg->realName());
     if (msg->isAway())
         format += tr(" - away");
     if (msg->isServOp())
@@ -560,7 +1112,7 @@ MessageData MessageFormatter::formatClass(const QString& format, IrcMessage* msg
     }
 
     if (!format.isEmpty())
-        data.setFormat(tr("<span class='%1'>%2</span>").arg(cls, format));
+        data.setFormat(fill(QT_TR_NOOP("<span class='%1'>%2</span>"), cls, format));
     return data;
 }
 
@@ -577,9 +1129,21 @@ QString MessageFormatter::formatSender(IrcMessage* msg) const
 
 void MessageFormatter::indexNames(const QStringList& names)
 {
-    d.names.clear();
-    foreach (const QString& name, names) {
-        if (!name.isEmpty())
-            d.names.insert(name.at(0), name);
+    d.names.setNicks(names);
+}
+
+void MessageFormatter::updateCaseMapping(IrcNumericMessage* msg)
+{
+    // the server buffer sees RPL_ISUPPORT first, the connection property
+    // carries it over to the buffers created after registration
+    if (msg->code() != Irc::RPL_ISUPPORT || !d.buffer || msg->connection() != d.buffer->connection())
+        return;
+
+    foreach (const QString& param, msg->parameters()) {
+        if (param.startsWith("CASEMAPPING=", Qt::CaseInsensitive)) {
+            const QString mapping = param.mid(12);
+            msg->connection()->setProperty("caseMapping", mapping);
+            d.names.setCaseMapping(NickMatcher::caseMapping(mapping));
+        }
     }
 }
@@ -30,15 +30,20 @@
 #define MESSAGEFORMATTER_H
 
 #include <QHash>
+#include <QPointer>
 #include <QColor>
 #include <QString>
+#include <QStringList>
+#include <QVariantMap>
 #include <QDateTime>
 #include <IrcGlobal>
 #include <IrcMessage>
 #include "baseglobal.h"
 #include "messagedata.h"
+#include "nickmatcher.h"
 
 class IrcBuffer;
+class StyleCache;
 class IrcUserModel;
 class IrcTextFormat;
 
@@ -60,6 +65,22 @@ public:
     MessageData formatMessage(IrcMessage* msg);
     QString formatText(const QString& text) const;
 
+    MessageData prepareMessage(IrcMessage* msg, QStringList* texts);
+    static MessageData finishMessage(const MessageData& data, const QStringList& texts, const NickMatcher& names);
+    static QString formatText(const QString& text, const NickMatcher& names);
+    NickMatcher names() const;
+    void setNames(const NickMatcher& names);
+
+    Q_INVOKABLE QVariantMap memoryUsage() const;
+
+    struct Run
+    {
+        QString text;
+        QString href;
+        QStringList styles;
+    };
+    static bool formatRuns(const QString& html, QList<Run>* runs);
+
     enum StyleFlag
     {
         None = 0x0,
@@ -102,13 +123,16 @@ protected:
 
 private slots:
     void indexNames(const QStringList& names);
+    void updateCaseMapping(IrcNumericMessage* msg);
 
 private:
     struct Private {
         IrcBuffer* buffer;
         IrcUserModel* userModel;
         IrcTextFormat* textFormat;
-        QMultiHash<QChar, QString> names;
+        QStringList* texts;
+        NickMatcher names;
+        QPointer<StyleCache> styles;
     } d;
 };
 
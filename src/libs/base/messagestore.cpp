@@ -0,0 +1,498 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "messagestore.h"
+#include <QCoreApplication>
+#include <QStandardPaths>
+#include <QDataStream>
+#include <QAtomicInt>
+#include <QLockFile>
+#include <QFile>
+#include <QDir>
+
+// the spill files of each process live in a directory of their own, locked for
+// as long as the process runs, so that files left behind by a crash are found
+// and removed by the next instance
+class SpillDirectory
+{
+public:
+    SpillDirectory() : lock(0)
+    {
+        const QString root = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/scrollback";
+        QDir dir(root);
+        foreach (const QFileInfo& info, dir.entryInfoList(QDir::AllEntries | QDir::NoDotAndDotDot)) {
+            if (!info.isDir()) {
+                QFile::remove(info.filePath());
+                continue;
+            }
+            QLockFile stale(info.filePath() + "/lock");
+            stale.setStaleLockTime(0);
+            if (stale.tryLock(0)) {
+                stale.unlock();
+                QDir(info.filePath()).removeRecursively();
+            }
+        }
+
+        path = root + "/" + QString::number(QCoreApplication::applicationPid());
+        if (QDir().mkpath(path)) {
+            lock = new QLockFile(path + "/lock");
+            lock->setStaleLockTime(0);
+            lock->tryLock(0);
+        } else {
+            path.clear();
+        }
+    }
+
+    QString createPath()
+    {
+        return path + "/" + QString::number(counter.fetchAndAddRelaxed(1)) + ".seg";
+    }
+
+    ~SpillDirectory()
+    {
+        delete lock;
+        if (!path.isEmpty())
+            QDir().rmdir(path);
+    }
+
+    QString path;
+    QLockFile* lock;
+    QAtomicInt counter;
+};
+
+Q_GLOBAL_STATIC(SpillDirectory, spillDirectory)
+
+MessageStore::MessageStore(QObject* parent) : QObject(parent)
+{
+    d.hot = 0;
+    d.base = 0;
+    d.batch = 0;
+    d.first = 0;
+    d.maximum = 100000;
+    d.memory = 1000;
+    d.file = 0;
+}
+
+MessageStore::~MessageStore()
+{
+    removeFile();
+}
+
+int MessageStore::first() const
+{
+    return d.first;
+}
+
+int MessageStore::end() const
+{
+    return d.hot + d.messages.count();
+}
+
+int MessageStore::count() const
+{
+    return end() - d.first;
+}
+
+bool MessageStore::isEmpty() const
+{
+    return !count();
+}
+
+bool MessageStore::contains(int index) const
+{
+    return index >= d.first && index < end();
+}
+
+int MessageStore::maximumCount() const
+{
+    return d.maximum;
+}
+
+void MessageStore::setMaximumCount(int count)
+{
+    if (d.maximum != count) {
+        d.maximum = count;
+        trim();
+    }
+}
+
+int MessageStore::maximumMemoryCount() const
+{
+    return d.memory;
+}
+
+void MessageStore::setMaximumMemoryCount(int count)
+{
+    if (d.memory != count) {
+        d.memory = count;
+        trim();
+    }
+}
+
+int MessageStore::memoryCount() const
+{
+    return d.messages.count();
+}
+
+QVariantMap MessageStore::memoryUsage() const
+{
+    qint64 bytes = 0;
+    qint64 raw = 0;
+    foreach (const MessageData& message, d.messages) {
+        bytes += message.byteCount();
+        raw += message.data().size();
+    }
+
+    bytes += d.offsets.capacity() * sizeof(qint64);
+    const qint64 disk = d.file ? d.file->size() : 0;
+
+    QVariantMap usage;
+    usage.insert("messages", d.messages.count());
+    usage.insert("spilledMessages", count() - d.messages.count());
+    usage.insert("messageBytes", bytes);
+    usage.insert("rawBytes", raw);
+    usage.insert("diskBytes", disk);
+    usage.insert("error", d.error);
+    return usage;
+}
+
+QString MessageStore::errorString() const
+{
+    return d.error;
+}
+
+MessageData MessageStore::at(int index) const
+{
+    if (!contains(index))
+        return MessageData();
+    if (index >= d.hot)
+        return d.messages.at(index - d.hot);
+
+    MessageData message;
+    if (openFile()) {
+        message = read(index);
+        d.file->close();
+    }
+    return message;
+}
+
+MessageData MessageStore::latest() const
+{
+    if (d.messages.isEmpty())
+        return at(end() - 1);
+    return d.messages.last();
+}
+
+QList<MessageData> MessageStore::mid(int index, int count) const
+{
+    const int from = qMax(index, d.first);
+    const int to = qMin(index + count, end());
+    if (from >= to)
+        return QList<MessageData>();
+    if (from >= d.hot)
+        return d.messages.mid(from - d.hot, to - from);
+
+    QList<MessageData> messages;
+    messages.reserve(to - from);
+    const bool open = openFile();
+    for (int i = from; i < qMin(to, d.hot); ++i)
+        messages += open ? read(i) : MessageData();
+    if (open)
+        d.file->close();
+    if (to > d.hot)
+        messages += d.messages.mid(0, to - d.hot);
+    return messages;
+}
+
+int MessageStore::append(const MessageData& message)
+{
+    d.messages.append(message);
+    trim();
+    emit appended(message);
+    return end() - 1;
+}
+
+void MessageStore::replaceLatest(const MessageData& message)
+{
+    // spilled messages are immutable
+    if (d.messages.isEmpty()) {
+        append(message);
+    } else {
+        d.messages.last() = message;
+        emit replaced(message);
+    }
+}
+
+void MessageStore::replace(int index, const MessageData& message)
+{
+    if (!contains(index))
+        return;
+
+    if (index >= d.hot) {
+        d.messages[index - d.hot] = message;
+    } else {
+        // a spilled message is rewritten at the end of the file,
+        // its former record is reclaimed when the file is compacted
+        if (!openFile())
+            return;
+        const qint64 offset = d.file->size();
+        bool written = d.file->seek(offset);
+        QDataStream out(d.file);
+        if (written) {
+            out << message;
+            written = out.status() == QDataStream::Ok && d.file->flush();
+        }
+        if (!written) {
+            setError(d.file->errorString());
+            d.file->resize(offset);
+            d.file->close();
+            return;
+        }
+        d.file->close();
+        d.offsets[index - d.base] = offset;
+    }
+    emit changed(index, message);
+}
+
+void MessageStore::highlight(int index)
+{
+    if (contains(index))
+        emit highlighted(index);
+}
+
+void MessageStore::clear()
+{
+    removeFile();
+    d.offsets.clear();
+    d.hot = end();
+    d.base = d.hot;
+    d.first = d.hot;
+    d.messages.clear();
+}
+
+void MessageStore::hibernate()
+{
+    // the latest message stays in memory, it may still be merged into
+    spill(d.messages.count() - 1);
+
+    // let go of the list capacity as well
+    QList<MessageData> messages;
+    foreach (const MessageData& message, d.messages)
+        messages += message;
+    d.messages = messages;
+}
+
+bool MessageStore::isBatching() const
+{
+    return d.batch > 0;
+}
+
+void MessageStore::beginBatch()
+{
+    ++d.batch;
+}
+
+void MessageStore::endBatch()
+{
+    if (d.batch > 0 && !--d.batch)
+        emit batchFinished();
+}
+
+void MessageStore::trim()
+{
+    // spill a quarter of the hot tail at a time, instead of reopening
+    // the file for every message once the tail is full, and retry a
+    // failed spill once another quarter has been received
+    const int quarter = qMax(1, d.memory / 4);
+    if (d.memory > 0 && d.messages.count() > d.memory
+            && (d.error.isEmpty() || (d.messages.count() - d.memory) % quarter == 0))
+        spill(d.messages.count() - d.memory + d.memory / 4);
+
+    if (d.maximum > 0 && count() > d.maximum) {
+        d.first = end() - d.maximum;
+        while (d.hot < d.first) {
+            d.messages.removeFirst();
+            d.offsets += -1;
+            ++d.hot;
+        }
+        compact();
+    }
+}
+
+void MessageStore::spill(int count)
+{
+    count = qMin(count, d.messages.count());
+    if (count <= 0)
+        return;
+
+    if (!d.file)
+        d.file = createFile();
+
+    // messages that fail to spill stay in memory, so that history never
+    // reads back with holes, and spilling is retried on the next trim
+    if (!openFile()) {
+        if (d.file)
+            setError(d.file->errorString());
+        return;
+    }
+
+    const qint64 start = d.file->size();
+    QVector<qint64> offsets;
+    offsets.reserve(count);
+    bool written = d.file->seek(start);
+    QDataStream out(d.file);
+    for (int i = 0; written && i < count; ++i) {
+        offsets += d.file->pos();
+        out << d.messages.at(i);
+        written = out.status() == QDataStream::Ok;
+    }
+    written = written && d.file->flush();
+
+    if (!written) {
+        setError(d.file->errorString());
+        d.file->resize(start);
+        d.file->close();
+        return;
+    }
+    d.file->close();
+    setError(QString());
+
+    d.offsets += offsets;
+    for (int i = 0; i < count; ++i)
+        d.messages.removeFirst();
+    d.hot += count;
+    compact();
+}
+
+void MessageStore::compact()
+{
+    // dropped messages are forgotten from the front of the offsets, and the
+    // file is rewritten once more than half of it is no longer referenced
+    const int dropped = qMin(d.first - d.base, d.offsets.count());
+    if (dropped < 1024 || dropped < d.offsets.count() / 2)
+        return;
+
+    d.offsets.remove(0, dropped);
+    d.base = d.hot - d.offsets.count();
+
+    // replaced messages are rewritten at the end, so offsets are not sorted
+    qint64 start = -1;
+    foreach (qint64 offset, d.offsets) {
+        if (offset != -1 && (start == -1 || offset < start))
+            start = offset;
+    }
+
+    if (start == -1) {
+        removeFile();
+        return;
+    }
+
+    if (!d.file || start < d.file->size() - start)
+        return;
+
+    QFile* file = createFile();
+    bool copied = file && openFile() && d.file->seek(start) && file->open(QIODevice::WriteOnly);
+    while (copied && !d.file->atEnd()) {
+        const QByteArray data = d.file->read(1024 * 1024);
+        copied = !data.isEmpty() && file->write(data) == data.size();
+    }
+    copied = copied && file->flush();
+    d.file->close();
+
+    if (copied) {
+        file->close();
+        removeFile();
+        d.file = file;
+        for (int i = 0; i < d.offsets.count(); ++i) {
+            if (d.offsets.at(i) != -1)
+                d.offsets[i] -= start;
+        }
+    } else if (file) {
+        file->remove();
+        delete file;
+    }
+}
+
+QFile* MessageStore::createFile()
+{
+    // a plain file on a path of our own, QTemporaryFile keeps its
+    // descriptor open even when closed
+    const QString path = spillDirectory()->path;
+    if (path.isEmpty()) {
+        setError(tr("Cannot create the scrollback directory"));
+        return 0;
+    }
+
+    QFile* file = new QFile(spillDirectory()->createPath());
+    if (!file->open(QIODevice::ReadWrite | QIODevice::Truncate)) {
+        setError(file->errorString());
+        delete file;
+        return 0;
+    }
+    file->close();
+    return file;
+}
+
+void MessageStore::removeFile()
+{
+    if (d.file) {
+        d.file->remove();
+        delete d.file;
+        d.file = 0;
+    }
+}
+
+void MessageStore::setError(const QString& message)
+{
+    if (d.error != message) {
+        d.error = message;
+        if (!message.isEmpty())
+            emit error(message);
+    }
+}
+
+bool MessageStore::openFile() const
+{
+    // the file is only kept open while it is being read or written,
+    // so that idle buffers do not hold file descriptors
+    return d.file && (d.file->isOpen() || d.file->open(QIODevice::ReadWrite));
+}
+
+MessageData MessageStore::read(int index) const
+{
+    MessageData message;
+    const int i = index - d.base;
+    if (i < 0 || i >= d.offsets.count() || d.offsets.at(i) == -1)
+        return message;
+
+    if (d.file->seek(d.offsets.at(i))) {
+        QDataStream in(d.file);
+        in >> message;
+    }
+    return message;
+}
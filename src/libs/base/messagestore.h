@@ -0,0 +1,117 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MESSAGESTORE_H
+#define MESSAGESTORE_H
+
+#include <QList>
+#include <QObject>
+#include <QVector>
+#include <QVariantMap>
+#include "baseglobal.h"
+#include "messagedata.h"
+
+class QFile;
+
+class BASE_EXPORT MessageStore : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit MessageStore(QObject* parent = 0);
+    ~MessageStore();
+
+    // messages are addressed by stable indexes that keep counting
+    // up when old messages are dropped: [first(), end())
+    int first() const;
+    int end() const;
+    int count() const;
+    bool isEmpty() const;
+    bool contains(int index) const;
+
+    // the oldest messages are spilled to a disk file, the hot tail of
+    // at most maximumMemoryCount() recent messages is kept in memory
+    int maximumCount() const;
+    void setMaximumCount(int count);
+
+    int maximumMemoryCount() const;
+    void setMaximumMemoryCount(int count);
+
+    int memoryCount() const;
+    Q_INVOKABLE QVariantMap memoryUsage() const;
+
+    QString errorString() const;
+
+    MessageData at(int index) const;
+    MessageData latest() const;
+    QList<MessageData> mid(int index, int count) const;
+
+    int append(const MessageData& message);
+    void replaceLatest(const MessageData& message);
+    void replace(int index, const MessageData& message);
+    void highlight(int index);
+    void clear();
+    void hibernate();
+
+    bool isBatching() const;
+    void beginBatch();
+    void endBatch();
+
+signals:
+    void appended(const MessageData& message);
+    void replaced(const MessageData& message);
+    void changed(int index, const MessageData& message);
+    void highlighted(int index);
+    void batchFinished();
+    void error(const QString& message);
+
+private:
+    void trim();
+    void spill(int count);
+    void compact();
+    QFile* createFile();
+    void removeFile();
+    void setError(const QString& message);
+    bool openFile() const;
+    MessageData read(int index) const;
+
+    struct Private {
+        int hot;
+        int base;
+        int batch;
+        int first;
+        int maximum;
+        int memory;
+        QFile* file;
+        QString error;
+        QVector<qint64> offsets;
+        QList<MessageData> messages;
+    } d;
+};
+
+#endif // MESSAGESTORE_H
@@ -0,0 +1,191 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "messagetemplate.h"
+#include <QCoreApplication>
+#include <QReadWriteLock>
+#include <QAtomicInt>
+#include <QThread>
+#include <QEvent>
+#include <QHash>
+#include <QPair>
+#include <QMap>
+
+class TemplateCache : public QObject
+{
+public:
+    TemplateCache() : watching(false)
+    {
+        if (QCoreApplication* app = QCoreApplication::instance())
+            moveToThread(app->thread());
+    }
+
+    bool eventFilter(QObject* object, QEvent* event)
+    {
+        if (event->type() == QEvent::LanguageChange && object == QCoreApplication::instance())
+            MessageTemplate::clearCache();
+        return false;
+    }
+
+    bool watching;
+    QReadWriteLock lock;
+    QAtomicInt generation;
+    QHash<QPair<const char*, const char*>, MessageTemplate> templates;
+};
+
+Q_GLOBAL_STATIC(TemplateCache, templateCache)
+
+MessageTemplate::MessageTemplate()
+{
+    d.null = true;
+    d.count = 0;
+    d.length = 0;
+}
+
+MessageTemplate::MessageTemplate(const QString& text)
+{
+    d.null = false;
+    d.length = 0;
+
+    // split into literals and placeholders, numbering the placeholders
+    // from the lowest like the multi-arg QString::arg() does
+    QMap<int, int> numbers;
+    QList<int> order;
+    QString literal;
+    const int length = text.length();
+    int pos = 0;
+    while (pos < length) {
+        const QChar c = text.at(pos);
+        if (c == '%' && pos + 1 < length && text.at(pos + 1).isDigit()) {
+            int end = pos + 1;
+            int number = 0;
+            while (end < length && end - pos <= 2 && text.at(end).isDigit())
+                number = number * 10 + text.at(end++).digitValue();
+            if (number > 0) {
+                d.literals += literal;
+                d.length += literal.length();
+                literal.clear();
+                numbers.insert(number, 0);
+                order += number;
+                pos = end;
+                continue;
+            }
+        }
+        literal += c;
+        ++pos;
+    }
+    d.literals += literal;
+    d.length += literal.length();
+
+    int index = 0;
+    QMap<int, int>::iterator it = numbers.begin();
+    for (; it != numbers.end(); ++it)
+        it.value() = index++;
+    foreach (int number, order)
+        d.args += numbers.value(number);
+    d.count = numbers.count();
+}
+
+bool MessageTemplate::isNull() const
+{
+    return d.null;
+}
+
+int MessageTemplate::argumentCount() const
+{
+    return d.count;
+}
+
+QString MessageTemplate::apply(const QString& a1, const QString& a2, const QString& a3, const QString& a4) const
+{
+    const QString* args[] = { &a1, &a2, &a3, &a4 };
+
+    int length = d.length;
+    foreach (int arg, d.args) {
+        if (arg < 4)
+            length += args[arg]->length();
+    }
+
+    QString result;
+    result.reserve(length);
+    result += d.literals.first();
+    for (int i = 0; i < d.args.count(); ++i) {
+        if (d.args.at(i) < 4)
+            result += *args[d.args.at(i)];
+        result += d.literals.at(i + 1);
+    }
+    return result;
+}
+
+QString MessageTemplate::format(const char* context, const char* source, const QString& a1, const QString& a2, const QString& a3, const QString& a4)
+{
+    // the same source may be translated differently in another context
+    TemplateCache* cache = templateCache();
+    const QPair<const char*, const char*> key(context, source);
+    MessageTemplate tmpl;
+    bool watching = false;
+    int generation = 0;
+    {
+        QReadLocker locker(&cache->lock);
+        watching = cache->watching;
+        generation = cache->generation.load();
+        tmpl = cache->templates.value(key);
+    }
+
+    if (tmpl.isNull() || !watching) {
+        if (tmpl.isNull())
+            tmpl = MessageTemplate(QCoreApplication::translate(context, source));
+
+        QWriteLocker locker(&cache->lock);
+        if (!cache->watching) {
+            // the application object receives LanguageChange when translators change
+            QCoreApplication* app = QCoreApplication::instance();
+            if (app && app->thread() == QThread::currentThread()) {
+                app->installEventFilter(cache);
+                cache->watching = true;
+            }
+        }
+        // a translation made before the cache was cleared is not kept
+        if (generation == cache->generation.load() && !cache->templates.contains(key))
+            cache->templates.insert(key, tmpl);
+    }
+    return tmpl.apply(a1, a2, a3, a4);
+}
+
+void MessageTemplate::clearCache()
+{
+    TemplateCache* cache = templateCache();
+    QWriteLocker locker(&cache->lock);
+    cache->templates.clear();
+    cache->generation.ref();
+}
+
+int MessageTemplate::cacheGeneration()
+{
+    return templateCache()->generation.load();
+}
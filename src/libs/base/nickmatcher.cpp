@@ -0,0 +1,223 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "nickmatcher.h"
+
+static inline bool isWordChar(const QChar& c)
+{
+    return c.isLetterOrNumber() || c == '_';
+}
+
+NickMatcher::NickMatcher()
+{
+    d.removed = 0;
+    d.mapping = Rfc1459;
+}
+
+NickMatcher::CaseMapping NickMatcher::caseMapping() const
+{
+    return d.mapping;
+}
+
+void NickMatcher::setCaseMapping(CaseMapping mapping)
+{
+    if (d.mapping != mapping) {
+        d.mapping = mapping;
+        rebuild();
+    }
+}
+
+NickMatcher::CaseMapping NickMatcher::caseMapping(const QString& name)
+{
+    // the CASEMAPPING token of RPL_ISUPPORT, rfc1459 when not announced
+    if (name.compare("ascii", Qt::CaseInsensitive) == 0)
+        return Ascii;
+    if (name.compare("strict-rfc1459", Qt::CaseInsensitive) == 0)
+        return StrictRfc1459;
+    return Rfc1459;
+}
+
+bool NickMatcher::isEmpty() const
+{
+    return d.nicks.isEmpty();
+}
+
+int NickMatcher::count() const
+{
+    return d.nicks.count();
+}
+
+int NickMatcher::byteCount() const
+{
+    int bytes = sizeof(NickMatcher) + d.nodes.capacity() * sizeof(Node);
+    foreach (const QString& nick, d.nicks)
+        bytes += 4 * sizeof(void*) + nick.size() * sizeof(QChar);
+    return bytes;
+}
+
+void NickMatcher::insert(const QString& nick)
+{
+    if (nick.isEmpty() || d.nicks.contains(nick))
+        return;
+
+    d.nicks.insert(nick);
+    if (d.nodes.isEmpty()) {
+        Node root;
+        root.child = 0;
+        root.sibling = 0;
+        root.nick = false;
+        d.nodes += root;
+    }
+
+    // the children of a node are kept in a singly linked list of siblings
+    int node = 0;
+    foreach (const QChar& ch, nick) {
+        const QChar c = fold(ch);
+        int child = d.nodes.at(node).child;
+        while (child && d.nodes.at(child).c != c)
+            child = d.nodes.at(child).sibling;
+        if (!child) {
+            Node n;
+            n.c = c;
+            n.child = 0;
+            n.sibling = d.nodes.at(node).child;
+            n.nick = false;
+            child = d.nodes.count();
+            d.nodes += n;
+            d.nodes[node].child = child;
+        }
+        node = child;
+    }
+    d.nodes[node].nick = true;
+}
+
+void NickMatcher::remove(const QString& nick)
+{
+    if (!d.nicks.remove(nick))
+        return;
+
+    const int node = find(nick);
+    if (node > 0)
+        d.nodes[node].nick = false;
+
+    // nodes of removed nicks are left behind until they pile up
+    if (++d.removed > 64 && d.removed > d.nicks.count())
+        rebuild();
+}
+
+void NickMatcher::setNicks(const QStringList& nicks)
+{
+    const QSet<QString> current = d.nicks;
+    const QSet<QString> updated = nicks.toSet();
+    foreach (const QString& nick, current) {
+        if (!updated.contains(nick))
+            remove(nick);
+    }
+    foreach (const QString& nick, updated) {
+        if (!current.contains(nick))
+            insert(nick);
+    }
+}
+
+void NickMatcher::clear()
+{
+    d.removed = 0;
+    d.nicks.clear();
+    d.nodes.clear();
+}
+
+int NickMatcher::match(const QString& text, int pos) const
+{
+    // the longest nick at pos that ends at a word boundary
+    if (d.nodes.isEmpty() || !isBoundary(text, pos))
+        return 0;
+
+    int length = 0;
+    int node = 0;
+    for (int i = pos; i < text.length(); ++i) {
+        const QChar c = fold(text.at(i));
+        int child = d.nodes.at(node).child;
+        while (child && d.nodes.at(child).c != c)
+            child = d.nodes.at(child).sibling;
+        if (!child)
+            break;
+        node = child;
+        if (d.nodes.at(node).nick && isBoundary(text, i + 1))
+            length = i + 1 - pos;
+    }
+    return length;
+}
+
+bool NickMatcher::isBoundary(const QString& text, int pos)
+{
+    if (pos <= 0 || pos >= text.length())
+        return true;
+    return !isWordChar(text.at(pos - 1)) || !isWordChar(text.at(pos));
+}
+
+QChar NickMatcher::fold(const QChar& c) const
+{
+    // rfc1459 treats []\~ as the upper case of {}|^ and strict-rfc1459
+    // leaves out ~; non-ascii letters are folded as the nick regexp did
+    const ushort u = c.unicode();
+    if (u >= 'A' && u <= 'Z')
+        return QChar(u + ('a' - 'A'));
+    if (u >= '[' && u <= ']' && d.mapping != Ascii)
+        return QChar(u + ('{' - '['));
+    if (u == '~' && d.mapping == Rfc1459)
+        return QChar('^');
+    if (u < 0x80)
+        return c;
+    return c.toLower();
+}
+
+int NickMatcher::find(const QString& nick) const
+{
+    if (d.nodes.isEmpty())
+        return 0;
+
+    int node = 0;
+    foreach (const QChar& ch, nick) {
+        const QChar c = fold(ch);
+        int child = d.nodes.at(node).child;
+        while (child && d.nodes.at(child).c != c)
+            child = d.nodes.at(child).sibling;
+        if (!child)
+            return 0;
+        node = child;
+    }
+    return node;
+}
+
+void NickMatcher::rebuild()
+{
+    const QSet<QString> nicks = d.nicks;
+    clear();
+    foreach (const QString& nick, nicks)
+        insert(nick);
+}
@@ -0,0 +1,82 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef NICKMATCHER_H
+#define NICKMATCHER_H
+
+#include <QSet>
+#include <QString>
+#include <QVector>
+#include <QStringList>
+#include "baseglobal.h"
+
+class BASE_EXPORT NickMatcher
+{
+public:
+    NickMatcher();
+
+    enum CaseMapping { Ascii, Rfc1459, StrictRfc1459 };
+
+    CaseMapping caseMapping() const;
+    void setCaseMapping(CaseMapping mapping);
+    static CaseMapping caseMapping(const QString& name);
+
+    bool isEmpty() const;
+    int count() const;
+    int byteCount() const;
+
+    void insert(const QString& nick);
+    void remove(const QString& nick);
+    void setNicks(const QStringList& nicks);
+    void clear();
+
+    int match(const QString& text, int pos) const;
+
+    static bool isBoundary(const QString& text, int pos);
+
+private:
+    QChar fold(const QChar& c) const;
+    int find(const QString& nick) const;
+    void rebuild();
+
+    struct Node {
+        QChar c;
+        int child;
+        int sibling;
+        bool nick;
+    };
+
+    struct Private {
+        int removed;
+        CaseMapping mapping;
+        QSet<QString> nicks;
+        QVector<Node> nodes;
+    } d;
+};
+
+#endif // NICKMATCHER_H
@@ -42,11 +42,19 @@
 #include <QToolTip>
 #include <QAction>
 #include <QMenu>
+#include <qmath.h>
+
+// number of pages kept loaded above and below the viewport
+static const int FetchMargin = 2;
 
 TextBrowser::TextBrowser(QWidget* parent) : QTextBrowser(parent)
 {
     d.bud = 0;
     d.events = true;
+    d.fetching = false;
+    d.virtualized = false;
+    d.scroll = 0;
+    d.prefetch = 0;
 
     setOpenLinks(false);
     setTabChangesFocus(true);
@@ -54,6 +62,7 @@ TextBrowser::TextBrowser(QWidget* parent) : QTextBrowser(parent)
     setHorizontalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
 
     connect(this, SIGNAL(anchorClicked(QUrl)), this, SLOT(onAnchorClicked(QUrl)));
+    connect(verticalScrollBar(), SIGNAL(valueChanged(int)), this, SLOT(fetchMore()));
 }
 
 TextBrowser::~TextBrowser()
@@ -84,21 +93,27 @@ void TextBrowser::setDocument(TextDocument* document)
 {
     TextDocument* doc = qobject_cast<TextDocument*>(QTextBrowser::document());
     if (doc != document) {
+        if (d.scroll) {
+            killTimer(d.scroll);
+            d.scroll = 0;
+        }
         if (doc) {
             doc->setVisible(false);
             disconnect(doc->documentLayout(), SIGNAL(documentSizeChanged(QSizeF)), this, SLOT(keepAtBottom()));
             disconnect(doc, SIGNAL(lineRemoved(int)), this, SLOT(keepPosition(int)));
         }
         if (document) {
+            document->relayout(font(), viewport()->width());
             document->setVisible(true);
-            document->setDefaultFont(font());
             connect(document->documentLayout(), SIGNAL(documentSizeChanged(QSizeF)), this, SLOT(keepAtBottom()));
             connect(document, SIGNAL(lineRemoved(int)), this, SLOT(keepPosition(int)));
         }
         connect(this, SIGNAL(textChanged()), this, SLOT(moveCursorToBottom()));
         QTextBrowser::setDocument(document);
         disconnect(this, SIGNAL(textChanged()), this, SLOT(moveCursorToBottom()));
+        updateWindowSize();
         scrollToBottom();
+        schedulePrefetch();
         emit documentChanged(document);
     }
 }
@@ -172,6 +187,9 @@ void TextBrowser::resizeEvent(QResizeEvent* event)
 {
     QTextBrowser::resizeEvent(event);
 
+    if (d.virtualized)
+        updateWindowSize();
+
     // http://www.qtsoftware.com/developer/task-tracker/index_html?method=entry&id=240940
     QMetaObject::invokeMethod(this, "scrollToBottom", Qt::QueuedConnection);
 }
@@ -194,6 +212,39 @@ bool TextBrowser::isZoomed() const
     return f.pixelSize() != QFont().pixelSize();
 }
 
+bool TextBrowser::isVirtualized() const
+{
+    return d.virtualized;
+}
+
+void TextBrowser::setVirtualized(bool virtualized)
+{
+    if (d.virtualized != virtualized) {
+        d.virtualized = virtualized;
+        updateWindowSize();
+    }
+}
+
+int TextBrowser::pageLines() const
+{
+    // blocks use a proportional line height of 125%
+    const int lineHeight = qMax(1, qCeil(fontMetrics().lineSpacing() * 1.25));
+    return qMax(1, viewport()->height() / lineHeight);
+}
+
+void TextBrowser::updateWindowSize()
+{
+    TextDocument* doc = document();
+    if (doc) {
+        // in virtualized mode only the visible page and a small margin
+        // around it is loaded to the document and thus laid out
+        if (d.virtualized)
+            doc->setWindowSize(qMax(100, pageLines() * (2 * FetchMargin + 1)));
+        else
+            doc->setWindowSize(TextDocument::DefaultWindowSize);
+    }
+}
+
 QMenu* TextBrowser::createContextMenu(const QPoint& pos)
 {
     // QTextEdit::createStandardContextMenu() expects document coordinates
@@ -280,6 +331,12 @@ void TextBrowser::scrollToTop()
 
 void TextBrowser::scrollToBottom()
 {
+    TextDocument* doc = document();
+    if (doc && doc->canFetchNext()) {
+        d.fetching = true;
+        doc->fetchLatest();
+        d.fetching = false;
+    }
     verticalScrollBar()->triggerAction(QScrollBar::SliderToMaximum);
 }
 
@@ -336,18 +393,81 @@ void TextBrowser::wheelEvent(QWheelEvent* event)
 #endif // Q_OS_MAC
 }
 
+void TextBrowser::timerEvent(QTimerEvent* event)
+{
+    if (event->timerId() == d.scroll) {
+        killTimer(d.scroll);
+        d.scroll = 0;
+        scrollToBottom();
+    } else if (event->timerId() == d.prefetch) {
+        killTimer(d.prefetch);
+        d.prefetch = 0;
+        TextDocument* doc = document();
+        if (doc && doc->canFetchPrevious())
+            doc->prefetchPrevious(pageLines() * FetchMargin);
+    }
+    QTextBrowser::timerEvent(event);
+}
+
+void TextBrowser::schedulePrefetch()
+{
+    if (!d.prefetch)
+        d.prefetch = startTimer(0);
+}
+
 void TextBrowser::keepAtBottom()
 {
-    if (isAtBottom())
-        QMetaObject::invokeMethod(this, "scrollToBottom", Qt::QueuedConnection);
+    // lines appended in the same pass of the event loop are
+    // followed by a single scroll to the bottom
+    if (!d.fetching && !d.scroll && isAtBottom())
+        d.scroll = startTimer(0);
 }
 
 void TextBrowser::keepPosition(int delta)
 {
-    if (!isAtBottom())
+    // evictions are compensated before the next paint, unless
+    // the view is about to follow the bottom anyway
+    if (!d.fetching && !d.scroll && !isAtBottom())
         verticalScrollBar()->setValue(verticalScrollBar()->value() - delta);
 }
 
+void TextBrowser::fetchMore()
+{
+    TextDocument* doc = document();
+    if (!doc || d.fetching)
+        return;
+
+    schedulePrefetch();
+
+    QScrollBar* bar = verticalScrollBar();
+    const bool previous = bar->value() - bar->minimum() < bar->pageStep() && doc->canFetchPrevious();
+    const bool next = !previous && bar->maximum() - bar->value() < bar->pageStep() && doc->canFetchNext();
+    if (!previous && !next)
+        return;
+
+    d.fetching = true;
+
+    // anchor the block at the top of the viewport
+    const QAbstractTextDocumentLayout* layout = doc->documentLayout();
+    const QTextBlock block = doc->findBlock(cursorForPosition(QPoint(0, 0)).position());
+    const int index = doc->d.first + block.blockNumber();
+    const int offset = bar->value() - qRound(layout->blockBoundingRect(block).top());
+
+    const int count = pageLines() * FetchMargin;
+    if (previous)
+        doc->fetchPrevious(count);
+    else
+        doc->fetchNext(count);
+
+    const QTextBlock anchor = doc->findBlockByNumber(index - doc->d.first);
+    if (anchor.isValid()) {
+        bar->setRange(0, qMax(0, qCeil(doc->size().height()) - viewport()->height()));
+        bar->setValue(qRound(layout->blockBoundingRect(anchor).top()) + offset);
+    }
+
+    d.fetching = false;
+}
+
 void TextBrowser::moveCursorToBottom()
 {
     QTextCursor cursor = textCursor();
@@ -55,6 +55,9 @@ public:
     bool isAtBottom() const;
     bool isZoomed() const;
 
+    bool isVirtualized() const;
+    void setVirtualized(bool virtualized);
+
     QMenu* createContextMenu(const QPoint& pos);
 
 public slots:
@@ -77,11 +80,13 @@ protected:
     void keyPressEvent(QKeyEvent* event);
     void paintEvent(QPaintEvent* event);
     void resizeEvent(QResizeEvent* event);
+    void timerEvent(QTimerEvent* event);
     void wheelEvent(QWheelEvent* event);
 
 private slots:
     void keepAtBottom();
     void keepPosition(int delta);
+    void fetchMore();
     void onAnchorClicked(const QUrl& url);
 
     void onWhoisTriggered();
@@ -89,8 +94,16 @@ private slots:
     void onJoinTriggered();
 
 private:
+    int pageLines() const;
+    void updateWindowSize();
+    void schedulePrefetch();
+
     struct Private {
         bool events;
+        bool fetching;
+        bool virtualized;
+        int scroll;
+        int prefetch;
         QWidget* bud;
     } d;
 };
@@ -28,13 +28,19 @@
 
 #include "textdocument.h"
 #include "eventformatter.h"
+#include "messagestore.h"
+#include "textscheduler.h"
 #include <QAbstractTextDocumentLayout>
-#include <QTextDocumentFragment>
 #include <QTextBlockUserData>
 #include <IrcConnection>
 #include <QStylePainter>
 #include <QApplication>
 #include <QStyleOption>
+#include <QElapsedTimer>
+#include <QFutureWatcher>
+#include <QtConcurrentRun>
+#include <QFontMetricsF>
+#include <QTextLayout>
 #include <QTextCursor>
 #include <QTextBlock>
 #include <IrcMessage>
@@ -45,7 +51,9 @@
 #include <QFrame>
 #include <qmath.h>
 
-static int delay = 1000;
+static const int restyleBudget = 8;
+static const int styleProperty = QTextFormat::UserProperty + 1;
+static const int restoreSize = 200;
 
 class TextFrame : public QFrame
 {
@@ -82,32 +90,210 @@ public:
 
 struct TextBlockMessageData : QTextBlockUserData
 {
-    TextBlockMessageData(const MessageData& data) : data(data) { }
+    TextBlockMessageData(const MessageData& data) : data(data), stamp(0), generation(0), expanded(-1) { }
     MessageData data;
+    int stamp;
+    int generation;
+    int expanded;
+    QString tooltip;
+    QStringList selectors;
 };
 
+static QStringList styleSelectors(const QString& html)
+{
+    QStringList selectors;
+    selectors += "timestamp";
+    if (html.contains("<a "))
+        selectors += "a";
+
+    int index = html.indexOf("class='");
+    while (index != -1) {
+        index += 7;
+        const int end = html.indexOf('\'', index);
+        if (end == -1)
+            break;
+        foreach (const QString& cls, html.mid(index, end - index).split(' ', QString::SkipEmptyParts)) {
+            if (!selectors.contains(cls))
+                selectors += cls;
+        }
+        index = html.indexOf("class='", end);
+    }
+    return selectors;
+}
+
+// style sheets are numbered as they are set, so that the formats probed
+// for them are cached without keying on the whole style sheet text
+static QStringList& styleSheets()
+{
+    static QStringList sheets;
+    return sheets;
+}
+
+static int styleSheetId(const QString& css)
+{
+    QStringList& sheets = styleSheets();
+    int id = sheets.indexOf(css);
+    if (id == -1) {
+        id = sheets.count();
+        sheets += css;
+    }
+    return id;
+}
+
+static QTextCharFormat styleFormat(int sheet, const QFont& font, const QString& selector)
+{
+    static QHash<QString, QTextCharFormat> formats;
+    const QString key = QString::number(sheet) + '\n' + font.key() + '\n' + selector;
+    QHash<QString, QTextCharFormat>::const_iterator it = formats.constFind(key);
+    if (it != formats.constEnd())
+        return it.value();
+
+    if (formats.count() > 1000)
+        formats.clear();
+
+    QTextDocument doc;
+    doc.setDefaultFont(font);
+    doc.setDefaultStyleSheet(styleSheets().value(sheet));
+    if (selector.isEmpty())
+        doc.setHtml("x");
+    else if (selector == "a")
+        doc.setHtml("<a href='#'>x</a>");
+    else
+        doc.setHtml(QString("<span class='%1'>x</span>").arg(selector));
+
+    QTextCursor cursor(&doc);
+    cursor.setPosition(1);
+    const QTextCharFormat format = cursor.charFormat();
+    formats.insert(key, format);
+    return format;
+}
+
+static QList<int> styleProperties(const QTextCharFormat& format, const QTextCharFormat& base)
+{
+    QSet<int> properties;
+    QMapIterator<int, QVariant> it(format.properties());
+    while (it.hasNext()) {
+        it.next();
+        if (base.property(it.key()) != it.value())
+            properties.insert(it.key());
+    }
+    it = base.properties();
+    while (it.hasNext()) {
+        it.next();
+        if (!format.hasProperty(it.key()))
+            properties.insert(it.key());
+    }
+    properties.remove(QTextFormat::IsAnchor);
+    properties.remove(QTextFormat::AnchorHref);
+    properties.remove(QTextFormat::AnchorName);
+    return properties.toList();
+}
+
+struct TextMessageJob
+{
+    TextMessageJob() : batch(0), finished(false), message(0) { }
+    int batch;
+    bool finished;
+    IrcMessage* message;
+    MessageData data;
+    QStringList texts;
+};
+
+struct TextMessageRun
+{
+    QList<TextMessageJob*> jobs;
+    QFutureWatcher<QList<MessageData> >* watcher;
+};
+
+static QTextBlockFormat blockFormat(const MessageData& data)
+{
+    QTextBlockFormat format;
+    format.setLineHeight(125, QTextBlockFormat::ProportionalHeight);
+    if (data.type() == IrcMessage::Unknown)
+        format.setAlignment(Qt::AlignRight);
+    else
+        format.setAlignment(Qt::AlignLeft);
+    return format;
+}
+
 TextDocument::TextDocument(IrcBuffer* buffer) : QTextDocument(buffer)
+{
+    d.clone = false;
+    d.store = new MessageStore(buffer);
+
+    // the formatter and its user model live as long as the buffer's store
+    d.formatter = new MessageFormatter(d.store);
+    connect(d.formatter, SIGNAL(formatted(MessageData)), this, SLOT(append(MessageData)));
+    d.formatter->setBuffer(buffer);
+    d.events = new EventFormatter(d.store);
+
+    init(buffer);
+
+    connect(buffer, SIGNAL(messageReceived(IrcMessage*)), this, SLOT(receiveMessage(IrcMessage*)));
+}
+
+TextDocument::TextDocument(TextDocument* original) : QTextDocument(original->d.buffer)
+{
+    // messages are received and formatted once per buffer by the original
+    // document; clones share its store and formatter, and only keep their
+    // own window, layout and view state
+    d.clone = true;
+    d.original = original;
+    d.store = original->d.store;
+    d.formatter = original->d.formatter;
+    d.events = original->d.events;
+
+    init(original->d.buffer);
+
+    connect(original, SIGNAL(messageReceived(IrcMessage*)), this, SIGNAL(messageReceived(IrcMessage*)));
+}
+
+TextDocument::~TextDocument()
+{
+    foreach (TextMessageRun* run, d.runs) {
+        run->watcher->waitForFinished();
+        delete run;
+    }
+    foreach (TextMessageJob* job, d.jobs) {
+        delete job->message;
+        delete job;
+    }
+}
+
+void TextDocument::init(IrcBuffer* buffer)
 {
     qRegisterMetaType<TextDocument*>();
 
+    d.first = d.store->end();
     d.scrollbackMarkerPosition = -1;
     d.dirty = -1;
     d.rebuild = -1;
+    d.restyle = -1;
+    d.restyled = -1;
+    d.replace = -1;
+    d.prefetched = -1;
+    d.submit = -1;
+    d.generation = 0;
+    d.sheet = styleSheetId(QString());
+    d.blockHeight = 0;
+    d.release = 0;
+    d.released = false;
+    d.laidOut = false;
+    d.releaseTimeout = 0;
     d.lowlight = -1;
-    d.clone = false;
-    d.batch = false;
+    d.highlighted = false;
     d.buffer = buffer;
     d.visible = false;
 
-    d.formatter = new MessageFormatter(this);
-    connect(d.formatter, SIGNAL(formatted(MessageData)), this, SLOT(append(MessageData)));
-    d.formatter->setBuffer(buffer);
-
     setUndoRedoEnabled(false);
-    setMaximumBlockCount(1000);
+    setMaximumBlockCount(DefaultWindowSize);
 
+    connect(d.store, SIGNAL(appended(MessageData)), this, SLOT(onMessageAppended(MessageData)));
+    connect(d.store, SIGNAL(replaced(MessageData)), this, SLOT(onMessageReplaced(MessageData)));
+    connect(d.store, SIGNAL(changed(int,MessageData)), this, SLOT(onMessageChanged(int,MessageData)));
+    connect(d.store, SIGNAL(highlighted(int)), this, SLOT(onMessageHighlighted(int)));
+    connect(d.store, SIGNAL(batchFinished()), this, SLOT(onBatchFinished()));
     connect(buffer->connection(), SIGNAL(disconnected()), this, SLOT(lowlight()));
-    connect(buffer, SIGNAL(messageReceived(IrcMessage*)), this, SLOT(receiveMessage(IrcMessage*)));
 }
 
 QString TextDocument::timeStampFormat() const
@@ -118,8 +304,9 @@ QString TextDocument::timeStampFormat() const
 void TextDocument::setTimeStampFormat(const QString& format)
 {
     if (d.timeStampFormat != format) {
+        const QString previous = d.timeStampFormat;
         d.timeStampFormat = format;
-        scheduleRebuild();
+        scheduleRestyle(d.sheet, previous);
     }
 }
 
@@ -131,30 +318,36 @@ QString TextDocument::styleSheet() const
 void TextDocument::setStyleSheet(const QString& css)
 {
     if (d.css != css) {
+        const int previous = d.sheet;
         d.css = css;
+        d.sheet = styleSheetId(css);
+        d.runFormats.clear();
+        d.preformatted.clear();
         setDefaultStyleSheet(css);
-        scheduleRebuild();
+        scheduleRestyle(previous, d.timeStampFormat);
     }
 }
 
 TextDocument* TextDocument::clone()
 {
-    if (d.dirty > 0)
-        flush();
-
-    TextDocument* doc = new TextDocument(d.buffer);
+    TextDocument* doc = new TextDocument(this);
+    doc->setMaximumBlockCount(maximumBlockCount());
     doc->setDefaultStyleSheet(defaultStyleSheet());
-    QTextCursor(doc).insertFragment(QTextDocumentFragment(this));
     doc->rootFrame()->setFrameFormat(rootFrame()->frameFormat());
 
-    // TODO:
-    doc->d.scrollbackMarkerPosition = d.scrollbackMarkerPosition;
     doc->d.css = d.css;
+    doc->d.sheet = d.sheet;
+    doc->d.timeStampFormat = d.timeStampFormat;
+    doc->d.releaseTimeout = d.releaseTimeout;
+
+    // the window of the clone is loaded from the shared store once shown
+    doc->d.first = qMax(d.store->first(), d.store->end() - maximumBlockCount());
+    doc->d.queue = d.store->mid(doc->d.first, d.store->end() - doc->d.first);
+    if (!doc->d.queue.isEmpty())
+        doc->scheduleFlush();
+
     doc->d.lowlight = d.lowlight;
-    doc->d.buffer = d.buffer;
     doc->d.highlights = d.highlights;
-    doc->d.timeStampFormat = d.timeStampFormat;
-    doc->d.clone = true;
 
     return doc;
 }
@@ -169,6 +362,11 @@ IrcBuffer* TextDocument::buffer() const
     return d.buffer;
 }
 
+MessageStore* TextDocument::store() const
+{
+    return d.store;
+}
+
 MessageFormatter* TextDocument::formatter() const
 {
     return d.formatter;
@@ -176,12 +374,164 @@ MessageFormatter* TextDocument::formatter() const
 
 int TextDocument::totalCount() const
 {
-    int count = d.queue.count();
-    if (!isEmpty())
-        count += blockCount();
+    // block numbers map to store indexes relative to the first block,
+    // whether or not the corresponding message has been loaded yet
+    return d.store->end() - d.first;
+}
+
+int TextDocument::windowSize() const
+{
+    return maximumBlockCount();
+}
+
+void TextDocument::setWindowSize(int size)
+{
+    if (size <= 0)
+        size = DefaultWindowSize;
+    if (size == maximumBlockCount())
+        return;
+
+    if (!isEmpty() && blockCount() > size) {
+        if (d.dirty > 0)
+            flush();
+        QTextCursor cursor(this);
+        cursor.beginEditBlock();
+        evict(blockCount() - size);
+        cursor.endEditBlock();
+    }
+    setMaximumBlockCount(size);
+}
+
+bool TextDocument::canFetchPrevious() const
+{
+    return d.first > d.store->first();
+}
+
+bool TextDocument::canFetchNext() const
+{
+    return loadedEnd() < d.store->end();
+}
+
+int TextDocument::fetchPrevious(int count)
+{
+    const int first = qMax(d.store->first(), d.first - qMin(count, maximumBlockCount()));
+    count = d.first - first;
+    if (count <= 0)
+        return 0;
+
+    if (d.dirty > 0)
+        flush();
+
+    // make room at the bottom, older messages are inserted at the top
+    const int keep = maximumBlockCount() - count;
+    if (keep <= 0)
+        clear();
+
+    QTextCursor cursor(this);
+    cursor.beginEditBlock();
+    if (!isEmpty() && blockCount() > keep) {
+        cursor.setPosition(findBlockByNumber(keep).position() - 1);
+        cursor.movePosition(QTextCursor::End, QTextCursor::KeepAnchor);
+        cursor.removeSelectedText();
+    }
+
+    // the former first block keeps its style state, it may not have been restyled yet
+    int stamp = 0;
+    int generation = d.generation;
+    if (TextBlockMessageData* data = static_cast<TextBlockMessageData*>(firstBlock().userData())) {
+        stamp = data->stamp;
+        generation = data->generation;
+    }
+
+    const int blocks = isEmpty() ? count : count + 1;
+    QList<MessageData> messages;
+    if (d.prefetched != -1 && d.prefetched >= d.store->first() && d.prefetched <= first
+            && d.prefetched + d.prefetch.count() >= first + blocks)
+        messages = d.prefetch.mid(first - d.prefetched, blocks);
+    else
+        messages = d.store->mid(first, blocks);
+    d.prefetch.clear();
+    d.prefetched = -1;
+    cursor.movePosition(QTextCursor::Start);
+    for (int i = 0; i < count; ++i) {
+        insertFormat(cursor, messages.at(i));
+        if (i < blocks - 1)
+            cursor.insertBlock();
+    }
+
+    // splitting the former first block may have moved its user data,
+    // so (re-)assign the data of all touched blocks from the store
+    QTextBlock block = firstBlock();
+    for (int i = 0; i < blocks && block.isValid(); ++i, block = block.next()) {
+        setBlockData(block, messages.at(i));
+        QTextCursor(block).setBlockFormat(blockFormat(messages.at(i)));
+        if (i == count) {
+            TextBlockMessageData* data = static_cast<TextBlockMessageData*>(block.userData());
+            data->stamp = stamp;
+            data->generation = generation;
+        }
+    }
+    cursor.endEditBlock();
+
+    if (d.restyled != -1)
+        d.restyled += count;
+
+    d.first = first;
     return count;
 }
 
+int TextDocument::fetchNext(int count)
+{
+    const int from = loadedEnd();
+    const int to = qMin(d.store->end(), from + count);
+    if (from >= to)
+        return 0;
+
+    QTextCursor cursor(this);
+    cursor.beginEditBlock();
+    foreach (const MessageData& message, d.store->mid(from, to - from))
+        insert(cursor, message);
+    cursor.endEditBlock();
+    return to - from;
+}
+
+void TextDocument::prefetchPrevious(int count)
+{
+    // reads the page above the loaded window ahead of time, so that
+    // scrolling up does not wait for the spilled history on disk
+    const int first = qMax(d.store->first(), d.first - qMin(count, maximumBlockCount()));
+    if (first >= d.first || d.prefetched == first)
+        return;
+
+    // the latest message may still be replaced, it is never prefetched
+    const int end = qMin(d.first + 1, d.store->end() - 1);
+    if (first >= end)
+        return;
+
+    d.prefetch = d.store->mid(first, end - first);
+    d.prefetched = first;
+}
+
+void TextDocument::fetchLatest()
+{
+    if (!canFetchNext())
+        return;
+
+    const int first = qMax(d.store->first(), d.store->end() - maximumBlockCount());
+    d.first = first;
+    clear();
+    d.queue = d.store->mid(first, d.store->end() - first);
+    flush();
+}
+
+int TextDocument::loadedEnd() const
+{
+    int end = d.first + d.queue.count();
+    if (!isEmpty())
+        end += blockCount();
+    return end;
+}
+
 bool TextDocument::isVisible() const
 {
     return d.visible;
@@ -193,8 +543,20 @@ void TextDocument::setVisible(bool visible)
         return;
 
     if (visible) {
+        if (d.release > 0) {
+            killTimer(d.release);
+            d.release = 0;
+        }
+        if (d.released)
+            restore();
         if (d.dirty > 0)
             flush();
+        fetchLatest();
+        if (d.restyled != -1) {
+            restyle();
+            if (d.restyled != -1 && d.restyle <= 0)
+                d.restyle = startTimer(0);
+        }
 
         // Update scroll marker position before updating seen message timestamp
         if (latestMessageReceived() > latestMessageSeen()) {
@@ -205,7 +567,7 @@ void TextDocument::setVisible(bool visible)
                 if (blockData && blockData->data.timestamp() <= latestMessageSeen())
                     break;
 
-                d.scrollbackMarkerPosition = block.blockNumber();
+                d.scrollbackMarkerPosition = d.first + block.blockNumber();
                 block = block.previous();
             }
         }
@@ -213,25 +575,109 @@ void TextDocument::setVisible(bool visible)
         setLatestMessageSeen(latestMessageReceived());
     } else {
         d.scrollbackMarkerPosition = -1;
+        d.viewed.start();
+        if (d.releaseTimeout > 0)
+            d.release = startTimer(d.releaseTimeout);
     }
 
     d.visible = visible;
+    if (visible)
+        d.laidOut = true;
 }
 
-QDateTime TextDocument::latestMessageReceived() const
+void TextDocument::relayout(const QFont& font, int width)
 {
-    if (!d.queue.isEmpty())
-        return d.queue.last().timestamp();
+    // a hidden document laid out for another font or width is cut down to its
+    // bottom first, the visible region is laid out before history is fetched
+    if (!d.visible && blockCount() > restoreSize
+            && (defaultFont() != font || qRound(pageSize().width()) != width))
+        release();
+    setDefaultFont(font);
+}
 
-    QTextBlock block = lastBlock();
-    while (block.isValid()) {
-        if (TextBlockMessageData* blockData = static_cast<TextBlockMessageData*>(block.userData()))
-            return blockData->data.timestamp();
+int TextDocument::releaseTimeout() const
+{
+    return d.releaseTimeout;
+}
 
-        block = block.previous();
+void TextDocument::setReleaseTimeout(int msecs)
+{
+    if (d.releaseTimeout == msecs)
+        return;
+
+    d.releaseTimeout = msecs;
+    if (d.release > 0) {
+        killTimer(d.release);
+        d.release = 0;
     }
+    if (msecs > 0 && !d.visible && !d.released)
+        d.release = startTimer(qMax(0, msecs - (d.viewed.isValid() ? int(d.viewed.elapsed()) : 0)));
+}
+
+bool TextDocument::isReleased() const
+{
+    return d.released;
+}
+
+void TextDocument::release()
+{
+    if (d.visible || d.released)
+        return;
+
+    // the blocks and their layouts are dropped, the window is reloaded
+    // from the store once the document is shown again
+    if (d.dirty > 0) {
+        TextScheduler::instance()->unschedule(this);
+        d.dirty = 0;
+    }
+    if (d.rebuild > 0)
+        killTimer(d.rebuild);
+    if (d.restyle > 0)
+        killTimer(d.restyle);
+    if (d.replace > 0)
+        killTimer(d.replace);
+    d.rebuild = 0;
+    d.restyle = 0;
+    d.replace = 0;
+    d.restyled = -1;
+    d.restyleFormats.clear();
+    d.styles.clear();
+    d.replacement = MessageData();
+
+    const int end = loadedEnd();
+    d.queue.clear();
+    d.prefetch.clear();
+    d.prefetched = -1;
+    clear();
+    d.first = end;
+    d.released = true;
+    d.laidOut = false;
+}
+
+void TextDocument::hibernate()
+{
+    // once no document of the buffer has held a window for the idle
+    // timeout, the messages leave memory as well and are read back
+    // from disk when shown
+    foreach (TextDocument* doc, d.buffer->findChildren<TextDocument*>()) {
+        if (!doc->isReleased())
+            return;
+    }
+    d.store->hibernate();
+}
 
-    return QDateTime();
+void TextDocument::restore()
+{
+    // the bottom is loaded first, history is fetched as it gets scrolled to
+    d.released = false;
+    d.first = qMax(d.store->first(), d.store->end() - qMin(maximumBlockCount(), restoreSize));
+    d.queue = d.store->mid(d.first, d.store->end() - d.first);
+    flush();
+}
+
+QDateTime TextDocument::latestMessageReceived() const
+{
+    return d.store->latest().timestamp();
 }
 
 QDateTime TextDocument::latestMessageSeen() const
@@ -244,53 +690,107 @@ void TextDocument::setLatestMessageSeen(const QDateTime& timestamp)
     if (d.latestMessageSeen == timestamp)
         return;
 
+    const bool rewind = timestamp < d.latestMessageSeen;
     d.latestMessageSeen = timestamp;
+
+    // the counters are ordered by time, drop everything seen from the front
+    if (rewind) {
+        countUnread();
+    } else {
+        while (!d.unread.isEmpty() && d.unread.first() <= timestamp)
+            d.unread.removeFirst();
+        while (!d.unreadHighlights.isEmpty() && d.unreadHighlights.first() <= timestamp)
+            d.unreadHighlights.removeFirst();
+    }
+
     emit latestMessageSeenChanged(timestamp);
 }
 
 int TextDocument::unreadMessages() const
 {
-    int unread = 0;
+    return d.unread.count();
+}
 
-    // Note: The following logic assumes the queue and blocks are ordered by time
+int TextDocument::unreadHighlights() const
+{
+    return d.unreadHighlights.count();
+}
 
-    QListIterator<MessageData> iterator(d.queue);
-    iterator.toBack();
-    while (iterator.hasPrevious()) {
-        MessageData message = iterator.previous();
-        if (message.timestamp() <= d.latestMessageSeen)
-            return unread;
+QVariantMap TextDocument::memoryUsage() const
+{
+    // rough estimates of what Qt keeps per character and line of laid out text.
+    // QTextBlock::layout() creates the layout on demand, so the lines are only
+    // counted for documents that have been laid out since they were shown
+    qint64 layout = 0;
+    qint64 blocks = 0;
+    for (QTextBlock block = firstBlock(); block.isValid(); block = block.next()) {
+        if (d.laidOut) {
+            const QTextLayout* textLayout = block.layout();
+            if (textLayout->lineCount() > 0)
+                layout += block.length() * 32 + textLayout->lineCount() * 64;
+        }
+        if (TextBlockMessageData* data = static_cast<TextBlockMessageData*>(block.userData()))
+            blocks += sizeof(TextBlockMessageData) + data->tooltip.size() * sizeof(QChar);
+    }
 
-        if (message.type() != IrcMessage::Private && message.type() != IrcMessage::Notice)
-            continue;
+    qint64 queue = 0;
+    foreach (const MessageData& message, d.queue)
+        queue += message.byteCount();
+
+    const qint64 text = qint64(characterCount()) * sizeof(QChar);
+    const qint64 highlights = d.highlights.count() * sizeof(int);
+    const qint64 unread = (d.unread.count() + d.unreadHighlights.count()) * (sizeof(void*) + sizeof(QDateTime));
+
+    QVariantMap usage;
+    usage.insert("blocks", isEmpty() ? 0 : blockCount());
+    usage.insert("textBytes", text);
+    usage.insert("layoutBytes", layout);
+    usage.insert("blockDataBytes", blocks);
+    usage.insert("queued", d.queue.count());
+    usage.insert("queueBytes", queue);
+    usage.insert("highlights", d.highlights.count());
+    usage.insert("highlightBytes", highlights);
+    usage.insert("unreadBytes", unread);
+    usage.insert("released", d.released);
+    usage.insert("totalBytes", text + layout + blocks + queue + highlights + unread);
+    return usage;
+}
 
-        ++unread;
-    }
+void TextDocument::countUnread()
+{
+    d.unread.clear();
+    d.unreadHighlights.clear();
 
-    for (QTextBlock block = lastBlock(); block.isValid(); block = block.previous()) {
-        TextBlockMessageData* blockData = static_cast<TextBlockMessageData*>(block.userData());
-        if (!blockData)
-            continue;
+    // Note: The following logic assumes the store is ordered by time
 
-        MessageData message = blockData->data;
-        if (message.timestamp() <= d.latestMessageSeen)
-            break;
+    // walk back a page at a time, spilled history is read one page per open
+    for (int end = d.store->end(); end > d.store->first(); end -= 256) {
+        const QList<MessageData> messages = d.store->mid(end - 256, 256);
+        for (int i = messages.count() - 1; i >= 0; --i) {
+            const MessageData& message = messages.at(i);
+            if (message.isEmpty() || !message.timestamp().isValid())
+                continue;
 
-        if (message.type() != IrcMessage::Private && message.type() != IrcMessage::Notice)
-            continue;
+            if (message.timestamp() <= d.latestMessageSeen)
+                return;
 
-        ++unread;
-    }
+            if (message.type() != IrcMessage::Private && message.type() != IrcMessage::Notice)
+                continue;
 
-    return unread;
+            d.unread.prepend(message.timestamp());
+            if (message.isHighlight())
+                d.unreadHighlights.prepend(message.timestamp());
+        }
+    }
 }
 
 void TextDocument::lowlight(int block)
 {
     if (block == -1)
         block = totalCount() - 1;
-    if (d.lowlight != block) {
-        d.lowlight = block;
+    const int index = d.first + block;
+    if (d.lowlight != index) {
+        d.lowlight = index;
         updateBlock(block);
     }
 }
@@ -301,16 +801,26 @@ void TextDocument::addHighlight(int block)
     if (block == -1)
         block = max;
     if (block >= 0 && block <= max) {
-        QList<int>::iterator it = qLowerBound(d.highlights.begin(), d.highlights.end(), block);
-        d.highlights.insert(it, block);
+        // evicted highlights are pruned lazily
+        d.highlights.erase(d.highlights.begin(), qLowerBound(d.highlights.begin(), d.highlights.end(), d.store->first()));
+
+        const int index = d.first + block;
+        QVector<int>::iterator it = qLowerBound(d.highlights.begin(), d.highlights.end(), index);
+        if (it == d.highlights.end() || *it != index)
+            d.highlights.insert(it, index);
         updateBlock(block);
     }
 }
 
 void TextDocument::removeHighlight(int block)
 {
-    if (d.highlights.removeOne(block) && block >= 0 && block < totalCount())
-        updateBlock(block);
+    const int index = d.first + block;
+    QVector<int>::iterator it = qLowerBound(d.highlights.begin(), d.highlights.end(), index);
+    if (it != d.highlights.end() && *it == index) {
+        d.highlights.erase(it);
+        if (block >= 0 && block < totalCount())
+            updateBlock(block);
+    }
 }
 
 void TextDocument::reset()
@@ -319,16 +829,15 @@ void TextDocument::reset()
     d.lowlight = -1;
     d.highlights.clear();
     d.queue.clear();
+    d.unread.clear();
+    d.unreadHighlights.clear();
+    d.first = d.store->end();
 }
 
 void TextDocument::append(const MessageData& data)
 {
     if (!data.isEmpty()) {
-        MessageData last;
-        if (!d.queue.isEmpty())
-            last = d.queue.last();
-        else if (TextBlockMessageData* block = static_cast<TextBlockMessageData*>(lastBlock().userData()))
-            last = block->data;
+        const MessageData last = d.store->latest();
 
         if (!last.isEmpty() && data.type() != IrcMessage::Unknown && data.timestamp().date() != last.timestamp().date()) {
             MessageData dc;
@@ -336,42 +845,147 @@ void TextDocument::append(const MessageData& data)
             append(dc);
         }
 
+        // the store notifies all documents that share it
         MessageData msg = data;
-        const bool merge = last.canMerge(data);
-        if (merge) {
+        if (last.canMerge(data)) {
             msg.merge(last);
-            msg.setFormat(formatSummary(msg.getEvents()));
-            if (!d.queue.isEmpty())
-                d.queue.replace(d.queue.count() - 1, msg);
-        }
-        if (!d.batch && (d.dirty == 0 || d.visible)) {
-            QTextCursor cursor(this);
-            cursor.beginEditBlock();
-            if (merge) {
-                cursor.movePosition(QTextCursor::End);
-                cursor.movePosition(QTextCursor::StartOfBlock, QTextCursor::KeepAnchor);
-                cursor.removeSelectedText();
-                cursor.deletePreviousChar();
-            }
-            insert(cursor, msg);
-            cursor.endEditBlock();
+            msg.setFormat(formatSummary(msg));
+            d.store->replaceLatest(msg);
         } else {
-            if (!d.batch && d.dirty <= 0) {
-                d.dirty = startTimer(delay);
-                delay += 1000;
-            }
-            if (!merge)
-                d.queue += msg;
+            d.store->append(msg);
         }
     }
 }
 
+void TextDocument::onMessageAppended(const MessageData& message)
+{
+    if ((message.type() == IrcMessage::Private || message.type() == IrcMessage::Notice)
+            && message.timestamp().isValid() && message.timestamp() > d.latestMessageSeen) {
+        d.unread += message.timestamp();
+        if (message.isHighlight())
+            d.unreadHighlights += message.timestamp();
+        if (d.unread.count() > d.store->count())
+            d.unread.removeFirst();
+        while (d.unreadHighlights.count() > d.unread.count())
+            d.unreadHighlights.removeFirst();
+    }
+
+    // a hibernated store that keeps receiving messages grows its hot
+    // tail again, and is hibernated once more after the timeout
+    if (d.released && d.releaseTimeout > 0 && d.release <= 0)
+        d.release = startTimer(d.releaseTimeout);
+
+    // the window has been scrolled back in history or released, the
+    // message gets loaded from the store once the window catches up
+    if (d.released || loadedEnd() < d.store->end() - 1)
+        return;
+
+    if (d.replace > 0)
+        replaceLast();
+
+    const bool batch = d.store->isBatching();
+    if (!batch && (d.dirty == 0 || d.visible)) {
+        if (d.dirty > 0)
+            flush();
+        QTextCursor cursor(this);
+        cursor.beginEditBlock();
+        insert(cursor, message);
+        cursor.endEditBlock();
+    } else {
+        if (!batch)
+            scheduleFlush();
+        d.queue += message;
+        if (d.queue.count() >= 2 * maximumBlockCount())
+            trimQueue();
+    }
+}
+
+void TextDocument::onMessageReplaced(const MessageData& message)
+{
+    if (d.released || loadedEnd() < d.store->end())
+        return;
+
+    if (!d.queue.isEmpty()) {
+        d.queue.replace(d.queue.count() - 1, message);
+    } else if (!isEmpty()) {
+        // merging events are redrawn at most once per frame
+        d.replacement = message;
+        if (d.replace <= 0)
+            d.replace = startTimer(16);
+    }
+}
+
+void TextDocument::replace(int index, const MessageData& message)
+{
+    // the store notifies all documents that share it
+    d.store->replace(index, message);
+}
+
+void TextDocument::onMessageChanged(int index, const MessageData& message)
+{
+    if (d.released || index < d.first || index >= loadedEnd())
+        return;
+
+    const int blocks = isEmpty() ? 0 : blockCount();
+    const int number = index - d.first;
+    if (number >= blocks) {
+        d.queue.replace(number - blocks, message);
+        return;
+    }
+
+    // the block is rewritten in place, keeping its number and user state
+    QTextBlock block = findBlockByNumber(number);
+    QTextCursor cursor(block);
+    cursor.beginEditBlock();
+    cursor.movePosition(QTextCursor::EndOfBlock, QTextCursor::KeepAnchor);
+    cursor.removeSelectedText();
+    insertFormat(cursor, message);
+    setBlockData(block, message);
+    cursor.setBlockFormat(blockFormat(message));
+    cursor.endEditBlock();
+}
+
+void TextDocument::replaceLast()
+{
+    if (d.replace > 0) {
+        killTimer(d.replace);
+        d.replace = 0;
+    }
+
+    if (!d.replacement.isEmpty() && !isEmpty()) {
+        QTextCursor cursor(this);
+        cursor.beginEditBlock();
+        cursor.movePosition(QTextCursor::End);
+        cursor.movePosition(QTextCursor::StartOfBlock, QTextCursor::KeepAnchor);
+        cursor.removeSelectedText();
+        cursor.deletePreviousChar();
+        insert(cursor, d.replacement);
+        cursor.endEditBlock();
+    }
+    d.replacement = MessageData();
+}
+
+void TextDocument::onBatchFinished()
+{
+    if (!d.queue.isEmpty()) {
+        if (d.visible)
+            flush();
+        else
+            scheduleFlush();
+    }
+}
+
+void TextDocument::onMessageHighlighted(int index)
+{
+    addHighlight(index - d.first);
+}
+
 void TextDocument::drawForeground(QPainter* painter, const QRect& bounds)
 {
-    if (d.scrollbackMarkerPosition <= 0)
+    if (d.scrollbackMarkerPosition - d.first <= 0)
         return;
 
-    QTextBlock block = findBlockByNumber(d.scrollbackMarkerPosition);
+    QTextBlock block = findBlockByNumber(d.scrollbackMarkerPosition - d.first);
     if (!block.isValid())
         return;
 
@@ -408,10 +1022,10 @@ void TextDocument::drawBackground(QPainter* painter, const QRect& bounds)
     if (!highlightFrame)
         highlightFrame = new TextHighlight(static_cast<QWidget*>(painter->device()));
 
-    if (d.lowlight != -1) {
-        const QAbstractTextDocumentLayout* layout = documentLayout();
-        const int margin = qCeil(documentMargin());
-        const QTextBlock to = findBlockByNumber(d.lowlight);
+    if (d.lowlight >= d.first) {
+        QTextBlock to = findBlockByNumber(d.lowlight - d.first);
+        if (!to.isValid())
+            to = lastBlock();
         if (to.isValid()) {
             QRect br = layout->blockBoundingRect(to).toAlignedRect();
             br.setTop(0);
@@ -425,8 +1039,19 @@ void TextDocument::drawBackground(QPainter* painter, const QRect& bounds)
         }
     }
 
-    foreach (int highlight, d.highlights) {
-        QTextBlock block = findBlockByNumber(highlight);
+    if (d.highlights.isEmpty())
+        return;
+
+    // only look up the highlights between the first and the last visible block
+    const QTextBlock top = findBlock(layout->hitTest(bounds.topLeft(), Qt::FuzzyHit));
+    const QTextBlock bottom = findBlock(layout->hitTest(bounds.bottomRight(), Qt::FuzzyHit));
+    if (!top.isValid() || !bottom.isValid())
+        return;
+
+    const int last = d.first + bottom.blockNumber();
+    QVector<int>::const_iterator it = qLowerBound(d.highlights.constBegin(), d.highlights.constEnd(), d.first + top.blockNumber());
+    for (; it != d.highlights.constEnd() && *it <= last; ++it) {
+        QTextBlock block = findBlockByNumber(*it - d.first);
         if (block.isValid()) {
             QRect br = layout->blockBoundingRect(block).toAlignedRect();
             if (bounds.intersects(br)) {
@@ -445,9 +1070,15 @@ QString TextDocument::tooltip(const QPoint& point) const
     const int pos = documentLayout()->hitTest(point, Qt::FuzzyHit);
     const QTextBlock block = findBlock(pos);
     TextBlockMessageData* blockData = static_cast<TextBlockMessageData*>(block.userData());
-    if (blockData)
-        return formatEvents(blockData->data.getEvents());
-    return QString();
+    if (!blockData)
+        return QString();
+
+    // expanded on demand, and kept with the block until it is evicted or restyled
+    if (blockData->expanded != d.generation) {
+        blockData->tooltip = formatEvents(blockData->data.getEvents());
+        blockData->expanded = d.generation;
+    }
+    return blockData->tooltip;
 }
 
 void TextDocument::updateBlock(int number)
@@ -462,19 +1093,39 @@ void TextDocument::updateBlock(int number)
 void TextDocument::timerEvent(QTimerEvent* event)
 {
     QTextDocument::timerEvent(event);
-    if (event->timerId() == d.dirty) {
-        delay -= 1000;
-        flush();
-    } else if (event->timerId() == d.rebuild) {
+    if (event->timerId() == d.rebuild) {
         rebuild();
+    } else if (event->timerId() == d.replace) {
+        if (loadedEnd() == d.store->end())
+            replaceLast();
+        else
+            d.replacement = MessageData();
+        killTimer(d.replace);
+        d.replace = 0;
+    } else if (event->timerId() == d.submit) {
+        submit();
+    } else if (event->timerId() == d.release) {
+        killTimer(d.release);
+        d.release = 0;
+        TextScheduler::instance()->release(this);
+    } else if (event->timerId() == d.restyle) {
+        if (d.visible) {
+            restyle();
+        } else {
+            killTimer(d.restyle);
+            d.restyle = 0;
+        }
     }
 }
 
 void TextDocument::flush()
 {
     if (!d.queue.isEmpty()) {
+        trimQueue();
         QTextCursor cursor(this);
         cursor.beginEditBlock();
+        if (!isEmpty())
+            evict(blockCount() + d.queue.count() - maximumBlockCount());
         foreach (const MessageData& data, d.queue)
             insert(cursor, data);
         cursor.endEditBlock();
@@ -482,64 +1133,293 @@ void TextDocument::flush()
     }
 
     if (d.dirty > 0) {
-        killTimer(d.dirty);
+        TextScheduler::instance()->unschedule(this);
         d.dirty = 0;
     }
+    d.highlighted = false;
+}
+
+bool TextDocument::flush(int msecs)
+{
+    QElapsedTimer timer;
+    timer.start();
+    trimQueue();
+
+    int count = 0;
+    QTextCursor cursor(this);
+    cursor.beginEditBlock();
+    while (count < d.queue.count() && (!count || !timer.hasExpired(msecs)))
+        insert(cursor, d.queue.at(count++));
+    cursor.endEditBlock();
+    d.queue = d.queue.mid(count);
+
+    if (!d.queue.isEmpty())
+        return false;
+    flush();
+    return true;
+}
+
+void TextDocument::trimQueue()
+{
+    // queued messages that would be evicted right away stay in the store
+    const int excess = d.queue.count() - maximumBlockCount();
+    if (excess >= 0) {
+        const int end = loadedEnd();
+        d.queue = d.queue.mid(excess);
+        clear();
+        d.first = end - d.queue.count();
+    }
+}
+
+void TextDocument::scheduleFlush()
+{
+    if (d.dirty <= 0) {
+        d.dirty = 1;
+        TextScheduler::instance()->schedule(this);
+    }
 }
 
 void TextDocument::receiveMessage(IrcMessage* message)
 {
+    // the shared store must receive each message only once
+    if (d.clone && d.original) {
+        d.original->receiveMessage(message);
+        return;
+    }
+
     if (message->type() == IrcMessage::Batch) {
         IrcBatchMessage* batch = static_cast<IrcBatchMessage*>(message);
-        d.batch = true;
+        const QString type = batch->batch().toLower();
+        if (type == "netsplit" || type == "netjoin") {
+            receiveEvents(batch->messages());
+            return;
+        }
+        queueBatch(1);
         foreach (IrcMessage* msg, batch->messages())
             receiveMessage(msg);
-        d.batch = false;
-        if (!d.queue.isEmpty()) {
-            if (d.visible) {
-                flush();
-            } else if (d.dirty <= 0) {
-                d.dirty = startTimer(delay);
-                delay += 1000;
+        queueBatch(-1);
+        return;
+    }
+
+    // other messages depend on GUI-thread state or emit extra lines while
+    // formatted, and own messages are committed before the signals let
+    // plugins look at their block, so these wait for pending content
+    const IrcMessage::Type type = MessageData::effectiveType(message);
+    if ((type != IrcMessage::Private && type != IrcMessage::Notice) || message->isOwn()) {
+        waitForFinished();
+        processMessage(message, d.formatter->formatMessage(message));
+        return;
+    }
+
+    // the content is formatted and linked in a worker thread, the GUI
+    // thread only fills the template and inserts the result
+    QStringList texts;
+    const MessageData data = d.formatter->prepareMessage(message, &texts);
+    if (texts.isEmpty() && d.jobs.isEmpty())
+        processMessage(message, data);
+    else
+        queueMessage(message, data, texts);
+}
+
+void TextDocument::receiveEvents(const QList<IrcMessage*>& messages)
+{
+    // mass joins and quits are summarized in one pass,
+    // instead of merging and redrawing message by message
+    MessageData data;
+    IrcMessage* last = 0;
+    foreach (IrcMessage* msg, messages) {
+        MessageData event;
+        event.initFrom(msg);
+        if (last && data.canMerge(event)) {
+            event.merge(data);
+        } else {
+            if (last)
+                receiveSummary(last, data);
+            last = 0;
+            if (!event.canMerge(event)) {
+                receiveMessage(msg);
+                continue;
             }
         }
+        data = event;
+        last = msg;
+    }
+    if (last)
+        receiveSummary(last, data);
+}
+
+void TextDocument::receiveSummary(IrcMessage* message, const MessageData& summary)
+{
+    waitForFinished();
+
+    MessageData data = summary;
+    if (data.summary())
+        data.setFormat(formatSummary(data));
+    else
+        data = d.formatter->formatMessage(message);
+    processMessage(message, data);
+}
+
+static QList<MessageData> finishMessages(const QList<MessageData>& data, const QList<QStringList>& texts, const NickMatcher& names)
+{
+    QList<MessageData> results;
+    for (int i = 0; i < data.count(); ++i)
+        results += MessageFormatter::finishMessage(data.at(i), texts.at(i), names);
+    return results;
+}
+
+void TextDocument::queueMessage(IrcMessage* message, const MessageData& data, const QStringList& texts)
+{
+    // the signals of deferred messages are emitted once they are committed,
+    // so they get a copy of the original that outlives its delivery
+    TextMessageJob* job = new TextMessageJob;
+    job->message = message->clone(this);
+    foreach (const QByteArray& name, message->dynamicPropertyNames())
+        job->message->setProperty(name, message->property(name));
+    job->data = data;
+    job->texts = texts;
+    job->finished = texts.isEmpty();
+    d.jobs += job;
+
+    // content received together is formatted in one worker run
+    if (!job->finished) {
+        d.pending += job;
+        if (d.submit <= 0)
+            d.submit = startTimer(0);
+    }
+}
+
+void TextDocument::queueBatch(int batch)
+{
+    if (d.jobs.isEmpty()) {
+        if (batch > 0)
+            d.store->beginBatch();
+        else
+            d.store->endBatch();
     } else {
-        MessageData data = d.formatter->formatMessage(message);
-        if (!data.isEmpty()) {
-            bool unseen = message->timeStamp() > latestMessageSeen();
+        TextMessageJob* job = new TextMessageJob;
+        job->batch = batch;
+        job->finished = true;
+        d.jobs += job;
+    }
+}
 
-            append(data);
+void TextDocument::submit()
+{
+    if (d.submit > 0) {
+        killTimer(d.submit);
+        d.submit = 0;
+    }
+    if (d.pending.isEmpty())
+        return;
 
-            if (unseen && isVisible() && !(message->isOwn() && data.type() == IrcMessage::Join))
-                setLatestMessageSeen(message->timeStamp());
+    QList<MessageData> data;
+    QList<QStringList> texts;
+    foreach (TextMessageJob* job, d.pending) {
+        data += job->data;
+        texts += job->texts;
+        job->texts.clear();
+    }
+
+    TextMessageRun* run = new TextMessageRun;
+    run->jobs = d.pending;
+    run->watcher = new QFutureWatcher<QList<MessageData> >(this);
+    connect(run->watcher, SIGNAL(finished()), this, SLOT(commit()));
+    run->watcher->setFuture(QtConcurrent::run(&finishMessages, data, texts, d.formatter->names()));
+    d.runs += run;
+    d.pending.clear();
+}
 
-            if (data.type() == IrcMessage::Private || data.type() == IrcMessage::Notice) {
+void TextDocument::waitForFinished()
+{
+    if (d.jobs.isEmpty())
+        return;
+
+    submit();
+    foreach (TextMessageRun* run, d.runs)
+        run->watcher->waitForFinished();
+    commit();
+}
+
+void TextDocument::commit()
+{
+    // the watchers report finished asynchronously, so ask their futures
+    for (int i = 0; i < d.runs.count(); ) {
+        TextMessageRun* run = d.runs.at(i);
+        if (!run->watcher->future().isFinished()) {
+            ++i;
+            continue;
+        }
+        const QList<MessageData> results = run->watcher->result();
+        for (int j = 0; j < run->jobs.count(); ++j) {
+            run->jobs.at(j)->data = results.value(j);
+            run->jobs.at(j)->finished = true;
+        }
+        run->watcher->deleteLater();
+        delete run;
+        d.runs.removeAt(i);
+    }
+
+    while (!d.jobs.isEmpty() && d.jobs.first()->finished) {
+        TextMessageJob* job = d.jobs.takeFirst();
+        if (job->batch > 0)
+            d.store->beginBatch();
+        else if (job->batch < 0)
+            d.store->endBatch();
+        else
+            processMessage(job->message, job->data);
+        delete job->message;
+        delete job;
+    }
+}
+
+void TextDocument::processMessage(IrcMessage* message, const MessageData& data)
+{
+    if (!data.isEmpty()) {
+        bool unseen = message->timeStamp() > latestMessageSeen();
+
+        bool priv = false;
+        bool contains = false;
+        MessageData msg = data;
+        IrcConnection* connection = message->connection();
+        const bool content = data.type() == IrcMessage::Private || data.type() == IrcMessage::Notice;
+        if (content && !message->isOwn()) {
+            QString text;
+            if (data.type() == IrcMessage::Private) {
+                IrcPrivateMessage* pm = static_cast<IrcPrivateMessage*>(message);
+                text = pm->content();
+                priv = pm->isPrivate();
+            } else {
+                IrcNoticeMessage* nm = static_cast<IrcNoticeMessage*>(message);
+                text = nm->content();
+                priv = nm->isPrivate();
+            }
+            // flagged in the store, so that every document sharing it counts the highlight
+            contains = text.contains(connection->nickName(), Qt::CaseInsensitive);
+            msg.setHighlight(contains);
+        }
+
+        append(msg);
+
+        if (unseen && isVisible() && !(message->isOwn() && data.type() == IrcMessage::Join))
+            setLatestMessageSeen(message->timeStamp());
+
+        if (content) {
+            // plugins look up own messages in the last block
+            if (message->isOwn() && d.dirty > 0)
+                flush();
+            if (unseen)
+                emit messageReceived(message);
+
+            if (contains) {
+                if (connection->isConnected())
+                    d.store->highlight(d.store->end() - 1);
+                if (d.dirty > 0)
+                    d.highlighted = true;
                 if (unseen)
-                    emit messageReceived(message);
-
-                if (!message->isOwn()) {
-                    QString content;
-                    bool priv = false;
-                    if (data.type() == IrcMessage::Private) {
-                        IrcPrivateMessage* pm = static_cast<IrcPrivateMessage*>(message);
-                        content = pm->content();
-                        priv = pm->isPrivate();
-                    } else {
-                        IrcNoticeMessage* nm = static_cast<IrcNoticeMessage*>(message);
-                        content = nm->content();
-                        priv = nm->isPrivate();
-                    }
-                    IrcConnection* connection = message->connection();
-                    const bool contains = content.contains(connection->nickName(), Qt::CaseInsensitive);
-                    if (contains) {
-                        if (connection->isConnected())
-                            addHighlight(totalCount() - 1);
-                        if (unseen)
-                            emit messageHighlighted(message);
-                    } else if (unseen && priv && connection->isConnected()) {
-                        emit privateMessageReceived(message);
-                    }
-                }
+                    emit messageHighlighted(message);
+            } else if (!message->isOwn() && unseen && priv && connection->isConnected()) {
+                emit privateMessageReceived(message);
             }
         }
     }
@@ -547,40 +1427,301 @@ void TextDocument::receiveMessage(IrcMessage* message)
 
 void TextDocument::rebuild()
 {
-    QList<MessageData> lines;
-    QTextBlock block = firstBlock();
-    while (block.isValid()) {
-        TextBlockMessageData* blockData = static_cast<TextBlockMessageData*>(block.userData());
-        if (blockData)
-            lines += blockData->data;
-        block = block.next();
-    }
+    const int end = loadedEnd();
     clear();
-    d.queue = lines;
+    d.queue = d.store->mid(d.first, end - d.first);
     flush();
     if (d.rebuild > 0) {
         killTimer(d.rebuild);
         d.rebuild = 0;
     }
+    if (d.restyle > 0) {
+        killTimer(d.restyle);
+        d.restyle = 0;
+    }
+    d.restyled = -1;
+    d.restyleFormats.clear();
+    d.styles.clear();
 }
 
 void TextDocument::scheduleRebuild()
 {
-    if (d.rebuild < 0 && !isEmpty())
+    if (d.rebuild <= 0 && !isEmpty())
         d.rebuild = startTimer(isVisible() ? 0 : 1000);
 }
 
-void TextDocument::shiftLights(int diff)
+void TextDocument::restyle()
 {
-    QList<int>::iterator it = d.highlights.begin();
-    while (it != d.highlights.end()) {
-        *it -= diff;
-        if (*it < 0)
-            it = d.highlights.erase(it);
-        else
-            ++it;
+    QElapsedTimer timer;
+    timer.start();
+
+    // restyle from the bottom up, where the viewport usually is, and
+    // continue in the next slice once the time budget has been spent
+    QTextCursor cursor(this);
+    cursor.beginEditBlock();
+    QTextBlock block = findBlockByNumber(qMin(d.restyled, blockCount() - 1));
+    while (block.isValid() && !timer.hasExpired(restyleBudget)) {
+        TextBlockMessageData* data = static_cast<TextBlockMessageData*>(block.userData());
+        if (data && data->generation != d.generation)
+            restyleBlock(block, data);
+        block = block.previous();
+    }
+    cursor.endEditBlock();
+
+    d.restyled = block.isValid() ? block.blockNumber() : -1;
+    if (d.restyled == -1) {
+        d.restyleFormats.clear();
+        d.styles.clear();
+        if (d.restyle > 0) {
+            killTimer(d.restyle);
+            d.restyle = 0;
+        }
     }
-    d.lowlight -= diff;
+}
+
+void TextDocument::scheduleRestyle(int sheet, const QString& format)
+{
+    // blocks remember the generation they were styled in, so a change
+    // during a pending restyle maps each block from its own style and
+    // the incremental pass simply starts over from the bottom
+    d.styles.insert(d.generation, qMakePair(sheet, format));
+    ++d.generation;
+    d.restyleFormats.clear();
+
+    if (isEmpty()) {
+        d.styles.clear();
+        d.restyled = -1;
+        return;
+    }
+
+    d.restyled = blockCount() - 1;
+
+    // hidden documents are restyled when shown
+    if (d.visible && d.restyle <= 0)
+        d.restyle = startTimer(0);
+}
+
+void TextDocument::restyleBlock(const QTextBlock& block, TextBlockMessageData* data)
+{
+    QTextCursor cursor(block);
+    const QPair<int, QString> style = d.styles.value(data->generation, qMakePair(d.sheet, d.timeStampFormat));
+
+    if (style.first != d.sheet) {
+        QList<QTextFragment> fragments;
+        for (QTextBlock::iterator it = block.begin(); !it.atEnd(); ++it)
+            fragments += it.fragment();
+
+        const QString key = QString::number(data->generation) + '/' + data->selectors.join(" ") + '/';
+        foreach (const QTextFragment& fragment, fragments) {
+            const QString id = key + QString::number(fragment.charFormatIndex());
+            QHash<QString, QTextCharFormat>::iterator it = d.restyleFormats.find(id);
+            if (it == d.restyleFormats.end()) {
+                const QTextCharFormat format = fragment.charFormat();
+                if (format.hasProperty(styleProperty)) {
+                    // inserted as runs, the styles are known exactly
+                    QTextCharFormat restyled = runFormat(format.property(styleProperty).toStringList());
+                    if (format.isAnchor())
+                        restyled.setAnchorHref(format.anchorHref());
+                    it = d.restyleFormats.insert(id, restyled);
+                } else {
+                    it = d.restyleFormats.insert(id, restyleFormat(format, data->selectors, style.first));
+                }
+            }
+            if (it.value() != fragment.charFormat()) {
+                cursor.setPosition(fragment.position());
+                cursor.setPosition(fragment.position() + fragment.length(), QTextCursor::KeepAnchor);
+                cursor.setCharFormat(it.value());
+            }
+        }
+    }
+
+    if (style.second != d.timeStampFormat && !data->data.format().isEmpty()) {
+        const QString time = data->data.timestamp().time().toString(d.timeStampFormat);
+        QTextCharFormat format = styleFormat(d.sheet, defaultFont(), "timestamp");
+        if (data->stamp > 0) {
+            cursor.setPosition(block.position() + 1);
+            format = cursor.charFormat();
+        }
+        cursor.setPosition(block.position());
+        cursor.setPosition(block.position() + data->stamp, QTextCursor::KeepAnchor);
+        cursor.insertText(time, format);
+        data->stamp = time.length();
+    }
+
+    data->generation = d.generation;
+}
+
+QTextCharFormat TextDocument::restyleFormat(const QTextCharFormat& format, const QStringList& selectors, int sheet) const
+{
+    // the formats of the selectors before and after the change are known, so
+    // map the properties of the selectors that the fragment was styled with
+    const QFont font = defaultFont();
+    const QTextCharFormat before = styleFormat(sheet, font, QString());
+    const QTextCharFormat after = styleFormat(d.sheet, font, QString());
+
+    QTextCharFormat result = format;
+    foreach (int property, styleProperties(after, before)) {
+        if (format.property(property) == before.property(property)) {
+            if (after.hasProperty(property))
+                result.setProperty(property, after.property(property));
+            else
+                result.clearProperty(property);
+        }
+    }
+
+    QMultiMap<int, QString> matches;
+    foreach (const QString& selector, selectors) {
+        const QTextCharFormat old = styleFormat(sheet, font, selector);
+        const QList<int> properties = styleProperties(old, before);
+        if (properties.isEmpty())
+            continue;
+        bool match = true;
+        foreach (int property, properties) {
+            if (format.property(property) != old.property(property)) {
+                match = false;
+                break;
+            }
+        }
+        if (match)
+            matches.insert(properties.count(), selector);
+    }
+
+    // apply the least specific matches first
+    foreach (const QString& selector, matches) {
+        const QTextCharFormat old = styleFormat(sheet, font, selector);
+        const QTextCharFormat current = styleFormat(d.sheet, font, selector);
+        const QList<int> changes = styleProperties(current, after);
+        foreach (int property, styleProperties(old, before) + changes) {
+            const QTextCharFormat& source = changes.contains(property) ? current : after;
+            if (source.hasProperty(property))
+                result.setProperty(property, source.property(property));
+            else
+                result.clearProperty(property);
+        }
+    }
+    return result;
+}
+
+void TextDocument::setBlockData(QTextBlock block, const MessageData& data)
+{
+    TextBlockMessageData* blockData = new TextBlockMessageData(data);
+    blockData->stamp = data.format().isEmpty() ? 0 : data.timestamp().time().toString(d.timeStampFormat).length();
+    blockData->generation = d.generation;
+    blockData->selectors = styleSelectors(data.format());
+    block.setUserData(blockData);
+}
+
+QTextCharFormat TextDocument::runFormat(const QStringList& styles, bool* preformatted)
+{
+    const QString font = defaultFont().key();
+    if (d.runFont != font) {
+        d.runFont = font;
+        d.runFormats.clear();
+        d.preformatted.clear();
+    }
+
+    const QString key = styles.join("\n");
+    QHash<QString, QTextCharFormat>::const_iterator it = d.runFormats.constFind(key);
+    if (it == d.runFormats.constEnd()) {
+        // let the html parser cascade the style sheet once per combination of styles
+        QString html = "x  x";
+        for (int i = styles.count() - 1; i >= 0; --i) {
+            const QString& style = styles.at(i);
+            html = QString("<%1>%2</%3>").arg(style, html, style.left(style.indexOf(' ')));
+        }
+
+        QTextDocument doc;
+        doc.setDefaultFont(defaultFont());
+        doc.setDefaultStyleSheet(d.css);
+        doc.setHtml(html);
+
+        QTextCursor cursor(&doc);
+        cursor.setPosition(1);
+        QTextCharFormat format = cursor.charFormat();
+        format.setProperty(styleProperty, styles);
+        if (doc.toPlainText().contains("  "))
+            d.preformatted.insert(key);
+        it = d.runFormats.insert(key, format);
+    }
+
+    if (preformatted)
+        *preformatted = d.preformatted.contains(key);
+    return it.value();
+}
+
+void TextDocument::insertFormat(QTextCursor& cursor, const MessageData& data)
+{
+    if (!insertRuns(cursor, data))
+        cursor.insertHtml(formatBlock(data.timestamp(), data.format()));
+}
+
+bool TextDocument::insertRuns(QTextCursor& cursor, const MessageData& data)
+{
+    QList<MessageFormatter::Run> runs;
+    if (data.format().isEmpty() || !MessageFormatter::formatRuns(data.format(), &runs))
+        return false;
+
+    // equivalent to inserting formatBlock() as html
+    const QString time = data.timestamp().time().toString(d.timeStampFormat);
+    if (!time.isEmpty()) {
+        cursor.insertText(time, runFormat(QStringList() << "span class='timestamp'"));
+        cursor.insertText(" ", runFormat(QStringList()));
+    }
+
+    bool space = true;
+    foreach (const MessageFormatter::Run& run, runs) {
+        bool preformatted = false;
+        QTextCharFormat format = runFormat(run.styles, &preformatted);
+        if (format.isAnchor())
+            format.setAnchorHref(run.href);
+
+        QString text;
+        if (preformatted) {
+            text = run.text;
+            space = false;
+        } else {
+            text.reserve(run.text.length());
+            foreach (const QChar& c, run.text) {
+                if (c != ' ')
+                    text += c;
+                else if (!space)
+                    text += ' ';
+                space = c == ' ';
+            }
+        }
+        if (!text.isEmpty())
+            cursor.insertText(text, format);
+    }
+    return true;
+}
+
+void TextDocument::evict(int count)
+{
+    count = qMin(count, blockCount() - 1);
+    if (count <= 0)
+        return;
+
+    // measure what the layout has already laid out, without asking it to
+    // lay out blocks that are about to be removed, and estimate the rest
+    const QTextBlock last = findBlockByNumber(count);
+    const QTextLayout* top = firstBlock().layout();
+    const QTextLayout* bottom = last.layout();
+    qreal height = 0;
+    if (top->lineCount() > 0 && bottom->lineCount() > 0) {
+        height = bottom->position().y() - top->position().y();
+        d.blockHeight = height / count;
+    } else {
+        if (d.blockHeight <= 0)
+            d.blockHeight = QFontMetricsF(defaultFont()).lineSpacing() * 1.25;
+        height = d.blockHeight * count;
+    }
+
+    QTextCursor cursor(this);
+    cursor.setPosition(last.position(), QTextCursor::KeepAnchor);
+    cursor.removeSelectedText();
+
+    d.first += count;
+    emit lineRemoved(qRound(height));
 }
 
 void TextDocument::insert(QTextCursor& cursor, const MessageData& data)
@@ -588,39 +1729,25 @@ void TextDocument::insert(QTextCursor& cursor, const MessageData& data)
     cursor.movePosition(QTextCursor::End);
 
     if (!isEmpty()) {
-        const int count = blockCount();
-        const int max = maximumBlockCount();
-        const QRectF br = documentLayout()->blockBoundingRect(findBlockByNumber(0));
         cursor.insertBlock();
-
-        if (count >= max) {
-            emit lineRemoved(qRound(br.bottom()));
-            shiftLights(max - count + 1);
-        }
+        if (blockCount() > maximumBlockCount())
+            evict(blockCount() - maximumBlockCount());
     }
 
-    cursor.insertHtml(formatBlock(data.timestamp(), data.format()));
-    cursor.block().setUserData(new TextBlockMessageData(data));
-
-    QTextBlockFormat format = cursor.blockFormat();
-    format.setLineHeight(125, QTextBlockFormat::ProportionalHeight);
-    if (data.type() == IrcMessage::Unknown)
-        format.setAlignment(Qt::AlignRight);
-    else
-        format.setAlignment(Qt::AlignLeft);
-    cursor.setBlockFormat(format);
+    insertFormat(cursor, data);
+    setBlockData(cursor.block(), data);
+    cursor.setBlockFormat(blockFormat(data));
 }
 
 QString TextDocument::formatEvents(const QList<MessageData>& events) const
 {
-    EventFormatter formatter;
-    formatter.setBuffer(d.buffer);
+    d.events->setNames(d.formatter->names());
 
     QStringList lines;
     foreach (const MessageData& event, events) {
-        if (!event.isEmpty()) {
+        if (!event.data().isEmpty()) {
             IrcMessage* msg = IrcMessage::fromData(event.data(), d.buffer->connection());
-            lines += formatBlock(event.timestamp(), formatter.formatMessage(msg).format());
+            lines += formatBlock(event.timestamp(), d.events->formatMessage(msg).format());
             delete msg;
         }
     }
@@ -629,58 +1756,46 @@ QString TextDocument::formatEvents(const QList<MessageData>& events) const
     return QString();
 }
 
-QString TextDocument::formatSummary(const QList<MessageData>& events) const
+QString TextDocument::formatSummary(const MessageData& message) const
 {
     QStringList actions;
     QStringList changes;
-    QSet<QString> nicks;
-    QSet<IrcMessage::Type> handled;
-    EventFormatter formatter;
 
-    foreach (const MessageData& event, events) {
-        switch (event.type()) {
+    const MessageSummary* summary = message.summary();
+    if (!summary)
+        return message.format();
+
+    foreach (IrcMessage::Type type, summary->types) {
+        switch (type) {
         case IrcMessage::Join:
-            if (!handled.contains(event.type()))
-                actions += tr("joined");
+            actions += tr("joined");
             break;
         case IrcMessage::Part:
-            if (!handled.contains(event.type()))
-                actions += tr("left");
+            actions += tr("left");
+            break;
+        case IrcMessage::Error:
+            actions += tr("disconnected");
             break;
         case IrcMessage::Quit:
-            if (event.isError()) {
-                if (!handled.contains(IrcMessage::Error))
-                    actions += tr("disconnected");
-                nicks.insert(event.nick());
-                handled.insert(IrcMessage::Error);
-                continue;
-            } else {
-                if (!handled.contains(event.type()))
-                    actions += tr("quit");
-            }
+            actions += tr("quit");
             break;
         case IrcMessage::Kick:
-            if (!handled.contains(event.type()))
-                actions += tr("kicked");
+            actions += tr("kicked");
             break;
         case IrcMessage::Nick:
-            if (!handled.contains(event.type()))
-                changes += tr("nick");
+            changes += tr("nick");
             break;
         case IrcMessage::Mode:
-            if (!handled.contains(event.type()))
-                changes += tr("mode");
+            changes += tr("mode");
             break;
         case IrcMessage::Topic:
-            if (!handled.contains(event.type()))
-                changes += tr("topic");
+            changes += tr("topic");
             break;
         default:
             break;
         }
-        nicks.insert(event.nick());
-        handled.insert(event.type());
     }
+    const QSet<QString>& nicks = summary->nicks;
 
     if (!changes.isEmpty())
         actions += tr("changed %1").arg(changes.join(tr(" and ")));
@@ -689,10 +1804,10 @@ QString TextDocument::formatSummary(const QList<MessageData>& events) const
         actions = QStringList() << QStringList(actions.mid(0, actions.count() - 1)).join(tr(", ")) << actions.last();
 
     if (nicks.count() == 1)
-        return formatter.formatEvent(tr("%1 %2").arg(formatter.styledText(*nicks.begin(), MessageFormatter::Bold),
+        return d.events->formatEvent(tr("%1 %2").arg(d.events->styledText(*nicks.begin(), MessageFormatter::Bold),
                                                      actions.join(tr(" and "))));
 
-    return formatter.formatEvent(tr("%1 %2").arg(formatter.styledText(tr("%1 users").arg(nicks.count()), MessageFormatter::Bold),
+    return d.events->formatEvent(tr("%1 %2").arg(d.events->styledText(tr("%1 users").arg(nicks.count()), MessageFormatter::Bold),
                                                  actions.join(tr(" or "))));
 }
 
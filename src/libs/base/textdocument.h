@@ -30,15 +30,30 @@
 #define TEXTDOCUMENT_H
 
 #include <QTextDocument>
+#include <QTextBlock>
+#include <QTextFormat>
 #include <QMetaType>
 #include <QDateTime>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMap>
+#include <QPair>
+#include <QSet>
+#include <QVector>
+#include <QPointer>
+#include <QVariantMap>
 #include "baseglobal.h"
 #include "messagedata.h"
 
 class IrcBuffer;
 class IrcMessage;
 class MessageData;
+class MessageStore;
 class MessageFormatter;
+class EventFormatter;
+struct TextBlockMessageData;
+struct TextMessageJob;
+struct TextMessageRun;
 
 class BASE_EXPORT TextDocument : public QTextDocument
 {
@@ -46,6 +61,7 @@ class BASE_EXPORT TextDocument : public QTextDocument
 
 public:
     explicit TextDocument(IrcBuffer* buffer);
+    ~TextDocument();
 
     QString timeStampFormat() const;
     void setTimeStampFormat(const QString& format);
@@ -57,18 +73,39 @@ public:
     bool isClone() const;
 
     IrcBuffer* buffer() const;
+    MessageStore* store() const;
     MessageFormatter* formatter() const;
 
     int totalCount() const;
 
+    enum { DefaultWindowSize = 1000 };
+
+    int windowSize() const;
+    void setWindowSize(int size);
+
+    bool canFetchPrevious() const;
+    bool canFetchNext() const;
+    int fetchPrevious(int count);
+    int fetchNext(int count);
+    void fetchLatest();
+    void prefetchPrevious(int count);
+
     bool isVisible() const;
     void setVisible(bool visible);
+    void relayout(const QFont& font, int width);
+
+    int releaseTimeout() const;
+    void setReleaseTimeout(int msecs);
+    bool isReleased() const;
 
     QDateTime latestMessageSeen() const;
     void setLatestMessageSeen(const QDateTime& timestamp);
     QDateTime latestMessageReceived() const;
 
     int unreadMessages() const;
+    int unreadHighlights() const;
+
+    Q_INVOKABLE QVariantMap memoryUsage() const;
 
     void drawBackground(QPainter* painter, const QRect& bounds);
     void drawForeground(QPainter* painter, const QRect& bounds);
@@ -77,12 +114,15 @@ public:
 
 public slots:
     void reset();
+    void release();
     void lowlight(int block = -1);
     void addHighlight(int block = -1);
     void removeHighlight(int block);
     void append(const MessageData& message);
+    void replace(int index, const MessageData& message);
     void insert(QTextCursor& cursor, const MessageData& message);
     void receiveMessage(IrcMessage* message);
+    void waitForFinished();
 
 signals:
     void lineRemoved(int height);
@@ -98,32 +138,93 @@ protected:
 private slots:
     void flush();
     void rebuild();
+    void restyle();
+    void onMessageAppended(const MessageData& message);
+    void onMessageReplaced(const MessageData& message);
+    void onMessageChanged(int index, const MessageData& message);
+    void onMessageHighlighted(int index);
+    void onBatchFinished();
+    void commit();
 
 private:
+    explicit TextDocument(TextDocument* original);
+    void init(IrcBuffer* buffer);
+    void queueBatch(int batch);
+    void processMessage(IrcMessage* message, const MessageData& data);
+    void queueMessage(IrcMessage* message, const MessageData& data, const QStringList& texts);
+    void submit();
+    void receiveEvents(const QList<IrcMessage*>& messages);
+    void receiveSummary(IrcMessage* message, const MessageData& summary);
+    void replaceLast();
+    void countUnread();
+
+    bool flush(int msecs);
+    void scheduleFlush();
+    void trimQueue();
     void scheduleRebuild();
-    void shiftLights(int diff);
+    void scheduleRestyle(int sheet, const QString& format);
+    void restyleBlock(const QTextBlock& block, TextBlockMessageData* data);
+    QTextCharFormat restyleFormat(const QTextCharFormat& format, const QStringList& selectors, int sheet) const;
+    void setBlockData(QTextBlock block, const MessageData& data);
+    QTextCharFormat runFormat(const QStringList& styles, bool* preformatted = 0);
+    void insertFormat(QTextCursor& cursor, const MessageData& data);
+    bool insertRuns(QTextCursor& cursor, const MessageData& data);
+    void restore();
+    void hibernate();
+    void evict(int count);
+    int loadedEnd() const;
 
     QString formatEvents(const QList<MessageData>& events) const;
-    QString formatSummary(const QList<MessageData>& events) const;
+    QString formatSummary(const MessageData& message) const;
     QString formatBlock(const QDateTime& timestamp, const QString& message) const;
 
     friend class TextBrowser;
+    friend class TextScheduler;
 
     struct Private {
+        int first;
         int scrollbackMarkerPosition;
         int dirty;
         bool clone;
-        bool batch;
+        QPointer<TextDocument> original;
+        bool highlighted;
         int rebuild;
+        int restyle;
+        int restyled;
+        int replace;
+        MessageData replacement;
+        int generation;
+        qreal blockHeight;
+        QMap<int, QPair<int, QString> > styles;
+        QHash<QString, QTextCharFormat> restyleFormats;
+        QString runFont;
+        QHash<QString, QTextCharFormat> runFormats;
+        QSet<QString> preformatted;
         QString css;
+        int sheet;
         int lowlight;
         bool visible;
+        bool released;
+        bool laidOut;
+        int release;
+        int releaseTimeout;
         IrcBuffer* buffer;
         QDateTime latestMessageSeen;
-        QList<int> highlights;
+        QList<QDateTime> unread;
+        QList<QDateTime> unreadHighlights;
+        QElapsedTimer viewed;
+        QVector<int> highlights;
         QString timeStampFormat;
         QList<MessageData> queue;
+        int prefetched;
+        QList<MessageData> prefetch;
+        int submit;
+        QList<TextMessageJob*> jobs;
+        QList<TextMessageJob*> pending;
+        QList<TextMessageRun*> runs;
+        MessageStore* store;
         MessageFormatter* formatter;
+        EventFormatter* events;
     } d;
 };
 
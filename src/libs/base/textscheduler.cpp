@@ -0,0 +1,241 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "textscheduler.h"
+#include "textdocument.h"
+#include <QTimerEvent>
+
+// hidden documents collect messages for a while before being flushed
+static const int coalesce = 1000;
+static const int recent = 5 * 60 * 1000;
+
+TextScheduler::TextScheduler(QObject* parent) : QObject(parent)
+{
+    d.timer = 0;
+    d.slice = 4;
+    d.latency = 0;
+    d.maximum = 0;
+    d.clock.start();
+}
+
+TextScheduler* TextScheduler::instance()
+{
+    static TextScheduler scheduler;
+    return &scheduler;
+}
+
+int TextScheduler::timeSlice() const
+{
+    return d.slice;
+}
+
+void TextScheduler::setTimeSlice(int msecs)
+{
+    d.slice = qMax(1, msecs);
+}
+
+int TextScheduler::queueDepth() const
+{
+    return d.entries.count();
+}
+
+int TextScheduler::pendingMessages() const
+{
+    int count = 0;
+    foreach (const Entry& entry, d.entries)
+        count += entry.document->d.queue.count();
+    return count;
+}
+
+int TextScheduler::latency() const
+{
+    return d.latency;
+}
+
+int TextScheduler::maximumLatency() const
+{
+    return d.maximum;
+}
+
+QVariantMap TextScheduler::statistics() const
+{
+    QVariantMap statistics;
+    statistics.insert("queueDepth", queueDepth());
+    statistics.insert("pendingMessages", pendingMessages());
+    statistics.insert("latency", d.latency);
+    statistics.insert("maximumLatency", d.maximum);
+    return statistics;
+}
+
+void TextScheduler::schedule(TextDocument* document)
+{
+    foreach (const Entry& entry, d.entries) {
+        if (entry.document == document)
+            return;
+    }
+
+    Entry entry;
+    entry.document = document;
+    entry.scheduled = d.clock.elapsed();
+    entry.due = -1;
+    if (priority(entry) < 2)
+        entry.due = entry.scheduled;
+    d.entries += entry;
+    connect(document, SIGNAL(destroyed(QObject*)), this, SLOT(remove(QObject*)), Qt::UniqueConnection);
+    start();
+}
+
+void TextScheduler::unschedule(TextDocument* document)
+{
+    for (int i = 0; i < d.entries.count(); ++i) {
+        if (d.entries.at(i).document == document) {
+            d.entries.removeAt(i);
+            if (!d.releases.contains(document))
+                disconnect(document, SIGNAL(destroyed(QObject*)), this, SLOT(remove(QObject*)));
+            break;
+        }
+    }
+}
+
+void TextScheduler::release(TextDocument* document)
+{
+    // documents that went idle together are released one at a time, so
+    // that their spills do not stall the GUI thread in the same tick
+    if (!d.releases.contains(document)) {
+        d.releases += document;
+        connect(document, SIGNAL(destroyed(QObject*)), this, SLOT(remove(QObject*)), Qt::UniqueConnection);
+        start();
+    }
+}
+
+void TextScheduler::timerEvent(QTimerEvent* event)
+{
+    if (event->timerId() != d.timer) {
+        QObject::timerEvent(event);
+        return;
+    }
+
+    killTimer(d.timer);
+    d.timer = 0;
+
+    QElapsedTimer timer;
+    timer.start();
+    while (!timer.hasExpired(d.slice)) {
+        int next = -1;
+        int best = 0;
+        const qint64 now = d.clock.elapsed();
+        for (int i = 0; i < d.entries.count(); ++i) {
+            Entry& entry = d.entries[i];
+            if (isReady(entry)) {
+                // the latency is counted from when the document became due,
+                // not from the coalescing delay before it
+                if (entry.due == -1)
+                    entry.due = qMin(now, entry.scheduled + coalesce);
+                const int prio = priority(entry);
+                if (next == -1 || prio < best) {
+                    next = i;
+                    best = prio;
+                }
+            }
+        }
+        if (next == -1)
+            break;
+
+        // flushing unschedules the document once its queue is empty
+        TextDocument* document = d.entries.at(next).document;
+        const qint64 due = d.entries.at(next).due;
+        if (document->flush(qMax<int>(1, d.slice - timer.elapsed()))) {
+            d.latency = static_cast<int>(d.clock.elapsed() - due);
+            d.maximum = qMax(d.maximum, d.latency);
+        } else {
+            d.entries.move(next, d.entries.count() - 1);
+        }
+    }
+
+    while (!d.releases.isEmpty() && !timer.hasExpired(d.slice)) {
+        TextDocument* document = d.releases.takeFirst();
+        if (!contains(document))
+            disconnect(document, SIGNAL(destroyed(QObject*)), this, SLOT(remove(QObject*)));
+        document->release();
+        if (document->isReleased())
+            document->hibernate();
+    }
+    start();
+}
+
+void TextScheduler::remove(QObject* document)
+{
+    for (int i = 0; i < d.entries.count(); ++i) {
+        if (d.entries.at(i).document == document) {
+            d.entries.removeAt(i);
+            break;
+        }
+    }
+    d.releases.removeAll(static_cast<TextDocument*>(document));
+}
+
+bool TextScheduler::contains(TextDocument* document) const
+{
+    foreach (const Entry& entry, d.entries) {
+        if (entry.document == document)
+            return true;
+    }
+    return false;
+}
+
+bool TextScheduler::isReady(const Entry& entry) const
+{
+    return priority(entry) < 2 || d.clock.elapsed() - entry.scheduled >= coalesce;
+}
+
+int TextScheduler::priority(const Entry& entry) const
+{
+    const TextDocument* document = entry.document;
+    if (document->isVisible())
+        return 0;
+    if (document->d.highlighted)
+        return 1;
+    if (document->d.viewed.isValid() && !document->d.viewed.hasExpired(recent))
+        return 2;
+    return 3;
+}
+
+void TextScheduler::start()
+{
+    qint64 wait = d.releases.isEmpty() ? -1 : 0;
+    const qint64 now = d.clock.elapsed();
+    foreach (const Entry& entry, d.entries) {
+        const qint64 remaining = isReady(entry) ? 0 : entry.scheduled + coalesce - now;
+        if (wait == -1 || remaining < wait)
+            wait = remaining;
+    }
+
+    if (d.timer)
+        killTimer(d.timer);
+    d.timer = wait >= 0 ? startTimer(static_cast<int>(qMax<qint64>(0, wait))) : 0;
+}
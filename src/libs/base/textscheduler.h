@@ -0,0 +1,94 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef TEXTSCHEDULER_H
+#define TEXTSCHEDULER_H
+
+#include <QList>
+#include <QObject>
+#include <QVariantMap>
+#include <QElapsedTimer>
+#include "baseglobal.h"
+
+class TextDocument;
+
+class BASE_EXPORT TextScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    static TextScheduler* instance();
+
+    int timeSlice() const;
+    void setTimeSlice(int msecs);
+
+    int queueDepth() const;
+    int pendingMessages() const;
+
+    int latency() const;
+    int maximumLatency() const;
+
+    Q_INVOKABLE QVariantMap statistics() const;
+
+    void schedule(TextDocument* document);
+    void unschedule(TextDocument* document);
+
+    void release(TextDocument* document);
+
+protected:
+    void timerEvent(QTimerEvent* event);
+
+private slots:
+    void remove(QObject* document);
+
+private:
+    TextScheduler(QObject* parent = 0);
+
+    struct Entry {
+        TextDocument* document;
+        qint64 scheduled;
+        qint64 due;
+    };
+
+    bool isReady(const Entry& entry) const;
+    int priority(const Entry& entry) const;
+    bool contains(TextDocument* document) const;
+    void start();
+
+    struct Private {
+        int timer;
+        int slice;
+        int latency;
+        int maximum;
+        QElapsedTimer clock;
+        QList<Entry> entries;
+        QList<TextDocument*> releases;
+    } d;
+};
+
+#endif // TEXTSCHEDULER_H
@@ -31,8 +31,10 @@
 #include "syntaxhighlighter.h"
 #include "messageformatter.h"
 #include "textdocument.h"
+#include "messagestore.h"
 #include <IrcMessage>
 #include <IrcBuffer>
+#include <QSet>
 #include <qabstracttextdocumentlayout.h>
 
 VerifierPlugin::VerifierPlugin(QObject* parent) : QObject(parent)
@@ -54,38 +56,35 @@ void VerifierPlugin::documentAdded(TextDocument* document)
 
 void VerifierPlugin::onCommandVerified(int id, IrcMessage* message)
 {
-    foreach (TextDocument* doc, d.documents.values(id)) {
+    // the documents of a buffer share its store, the message is replaced once
+    QSet<MessageStore*> replaced;
+    typedef QPair<TextDocument*, int> Entry;
+    foreach (const Entry& entry, d.documents.values(id)) {
+        TextDocument* doc = entry.first;
         SyntaxHighlighter* highlighter = doc->findChild<SyntaxHighlighter*>();
         if (highlighter) {
             QTextBlock block = doc->lastBlock();
-            while (block.isValid()) {
-                if (block.userState() == id) {
-                    block.setUserState(-1);
-
-                    // FIXME: Allow selectively updating message data, e.g. just the timestamp
-
-                    MessageData data;
-                    if (message)
-                        data = doc->formatter()->formatMessage(message);
-                    if (!data.isEmpty()) {
-                        QTextCursor cursor(block);
-                        cursor.beginEditBlock();
-                        cursor.select(QTextCursor::BlockUnderCursor);
-                        cursor.removeSelectedText();
-                        doc->insert(cursor, data);
-                        cursor.endEditBlock();
-
-                        if (doc->isVisible() && data.timestamp() > doc->latestMessageSeen())
-                            doc->setLatestMessageSeen(data.timestamp());
+            while (block.isValid() && block.userState() != id)
+                block = block.previous();
+            if (block.isValid())
+                block.setUserState(-1);
 
-                    } else {
-                        highlighter->rehighlightBlock(block);
-                    }
+            // FIXME: Allow selectively updating message data, e.g. just the timestamp
 
-                    break;
+            MessageData data;
+            if (message)
+                data = doc->formatter()->formatMessage(message);
+            if (!data.isEmpty()) {
+                if (!replaced.contains(doc->store())) {
+                    replaced.insert(doc->store());
+                    doc->replace(entry.second, data);
                 }
 
-                block = block.previous();
+                if (doc->isVisible() && data.timestamp() > doc->latestMessageSeen())
+                    doc->setLatestMessageSeen(data.timestamp());
+
+            } else if (block.isValid()) {
+                highlighter->rehighlightBlock(block);
             }
         }
     }
@@ -102,9 +101,10 @@ void VerifierPlugin::onMessageReceived(IrcMessage* message)
             if (id > 1) {
                 SyntaxHighlighter* highlighter = doc->findChild<SyntaxHighlighter*>();
                 if (highlighter) {
+                    // own messages are in the store before they are signaled
                     QTextBlock block = doc->lastBlock();
                     block.setUserState(id);
-                    d.documents.insertMulti(id, doc);
+                    d.documents.insertMulti(id, qMakePair(doc, doc->store()->end() - 1));
                     highlighter->rehighlightBlock(block);
                 }
             }
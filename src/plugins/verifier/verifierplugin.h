@@ -30,6 +30,7 @@
 #define VERIFIERPLUGIN_H
 
 #include <QHash>
+#include <QPair>
 #include <QtPlugin>
 #include <QMultiHash>
 #include "connectionplugin.h"
@@ -59,7 +60,7 @@ private slots:
 
 private:
     struct Private {
-        QMultiHash<int, TextDocument*> documents;
+        QMultiHash<int, QPair<TextDocument*, int> > documents;
         QHash<IrcConnection*, CommandVerifier*> verifiers;
     } d;
 };
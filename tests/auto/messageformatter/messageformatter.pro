@@ -0,0 +1,11 @@
+######################################################################
+# Communi
+######################################################################
+
+TEMPLATE = app
+TARGET = tst_messageformatter
+CONFIG += communi communi_base testcase
+COMMUNI += core model util
+QT += testlib
+
+SOURCES += $$PWD/tst_messageformatter.cpp
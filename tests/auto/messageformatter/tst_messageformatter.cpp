@@ -0,0 +1,248 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <QtTest/QtTest>
+#include <IrcTextFormat>
+#include <IrcPalette>
+#include "messageformatter.h"
+#include "nickmatcher.h"
+
+class tst_MessageFormatter : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+
+    void links_data();
+    void links();
+
+    void customFormat();
+    void customPalette();
+
+    void fastPath_data();
+    void fastPath();
+
+private:
+    NickMatcher names;
+};
+
+static QStringList links(const QString& html)
+{
+    QStringList hrefs;
+    QRegExp rx("href=['\"]([^'\"]*)['\"]");
+    int pos = 0;
+    while ((pos = rx.indexIn(html, pos)) != -1) {
+        hrefs += rx.cap(1);
+        pos += rx.matchedLength();
+    }
+    return hrefs;
+}
+
+// the text with the effective classes at each change and all other tags,
+// so that nested and flattened spans compare equal; backgrounds are not
+// themed and entities are decoded
+static QString normalize(const QString& html)
+{
+    QList<QStringList> spans;
+    QString current;
+    QString out;
+    int pos = 0;
+    while (pos < html.length()) {
+        if (html.at(pos) == '<') {
+            const int end = html.indexOf('>', pos);
+            const QString tag = html.mid(pos + 1, end - pos - 1).replace('"', '\'');
+            pos = end + 1;
+            if (tag.startsWith("span")) {
+                QRegExp rx("class='([^']*)'");
+                QStringList classes;
+                if (rx.indexIn(tag) != -1)
+                    classes = rx.cap(1).split(' ', QString::SkipEmptyParts);
+                foreach (const QString& name, classes) {
+                    if (name.contains("background"))
+                        classes.removeAll(name);
+                }
+                spans += classes;
+            } else if (tag == "/span") {
+                if (!spans.isEmpty())
+                    spans.removeLast();
+            } else {
+                out += "<" + tag + ">";
+            }
+            continue;
+        }
+
+        QString c = html.at(pos);
+        if (html.at(pos) == '&') {
+            const int end = html.indexOf(';', pos);
+            const QString entity = html.mid(pos, end - pos + 1);
+            if (entity == "&amp;")
+                c = "&";
+            else if (entity == "&lt;")
+                c = "<";
+            else if (entity == "&gt;")
+                c = ">";
+            else if (entity == "&quot;")
+                c = "\"";
+            else if (entity == "&nbsp;")
+                c = " ";
+            pos = end + 1;
+        } else {
+            ++pos;
+        }
+
+        QStringList classes;
+        foreach (const QStringList& span, spans)
+            classes += span;
+        classes.removeDuplicates();
+        classes.sort();
+        if (classes.join(" ") != current) {
+            current = classes.join(" ");
+            out += "[" + current + "]";
+        }
+        out += c;
+    }
+    return out;
+}
+
+void tst_MessageFormatter::initTestCase()
+{
+    names.setNicks(QStringList() << "jpnurmi" << "nick" << "Guest42" << "Away{m}");
+}
+
+void tst_MessageFormatter::links_data()
+{
+    QTest::addColumn<QString>("text");
+    QTest::addColumn<QStringList>("hrefs");
+
+    QTest::newRow("channel") << QString("join #communi now") << (QStringList() << "channel:#communi");
+    QTest::newRow("channel punctuation") << QString("see #communi, (#qt).") << (QStringList() << "channel:#communi" << "channel:#qt");
+    QTest::newRow("channel at end") << QString("a lone hash at the end #") << QStringList();
+    QTest::newRow("channel alone") << QString("#") << QStringList();
+    QTest::newRow("double hash") << QString("##communi-dev") << (QStringList() << "channel:##communi-dev");
+
+    QTest::newRow("nick") << QString("jpnurmi: hi") << (QStringList() << "nick:jpnurmi");
+    QTest::newRow("nick at end") << QString("thanks nick") << (QStringList() << "nick:nick");
+    QTest::newRow("nick punctuation") << QString("hi (jpnurmi), <Guest42>!") << (QStringList() << "nick:jpnurmi" << "nick:Guest42");
+    QTest::newRow("nick addressed") << QString("@jpnurmi thanks") << (QStringList() << "nick:jpnurmi");
+    QTest::newRow("nick prefix") << QString("nicknames and jpnurmix") << QStringList();
+    QTest::newRow("nick suffix") << QString("surnick xjpnurmi") << QStringList();
+    QTest::newRow("nick underscore") << QString("nick_ and _nick") << QStringList();
+    QTest::newRow("nick case") << QString("JPNURMI: hi guest42") << (QStringList() << "nick:JPNURMI" << "nick:guest42");
+    QTest::newRow("nick rfc1459") << QString("away[M] is back") << (QStringList() << "nick:away[M]");
+    QTest::newRow("longest nick") << QString("Guest42 Guest4") << (QStringList() << "nick:Guest42");
+
+    QTest::newRow("url") << QString("see http://communi.github.io/.") << (QStringList() << "http://communi.github.io/");
+    QTest::newRow("url and nick") << QString("jpnurmi: https://example.com") << (QStringList() << "nick:jpnurmi" << "https://example.com");
+    QTest::newRow("www") << QString("www.example.com") << (QStringList() << "http://www.example.com");
+    QTest::newRow("email") << QString("mail jpnurmi@example.com") << (QStringList() << "mailto:jpnurmi@example.com");
+    QTest::newRow("not an email") << QString("nick@home and @ alone") << (QStringList() << "nick:nick");
+}
+
+void tst_MessageFormatter::links()
+{
+    QFETCH(QString, text);
+    QFETCH(QStringList, hrefs);
+
+    QCOMPARE(links(MessageFormatter::formatText(text, names)), hrefs);
+
+    MessageFormatter formatter;
+    formatter.setNames(names);
+    QCOMPARE(links(formatter.formatText(text)), hrefs);
+}
+
+void tst_MessageFormatter::customFormat()
+{
+    // a text format set by the application is used as is
+    const QString text("\x02" "bold\x02 \x03" "4red\x03 plain");
+
+    MessageFormatter formatter;
+    IrcTextFormat* format = new IrcTextFormat(&formatter);
+    format->setSpanFormat(IrcTextFormat::SpanStyle);
+    formatter.setTextFormat(format);
+    QCOMPARE(formatter.formatText(text), format->toHtml(text));
+}
+
+void tst_MessageFormatter::customPalette()
+{
+    const QString text("\x03" "4red\x03 plain");
+
+    MessageFormatter formatter;
+    formatter.textFormat()->palette()->setColorName(Irc::Red, "crimson");
+    QCOMPARE(formatter.formatText(text), formatter.textFormat()->toHtml(text));
+    QVERIFY(formatter.formatText(text).contains("crimson"));
+}
+
+void tst_MessageFormatter::fastPath_data()
+{
+    QTest::addColumn<QString>("text");
+
+    QTest::newRow("plain") << QString("just some text");
+    QTest::newRow("bold") << QString("\x02" "bold\x02 plain");
+    QTest::newRow("italic underline strike") << QString("\x1d" "italic\x1d \x1f" "underline\x1f \x1e" "strike\x1e");
+    QTest::newRow("color") << QString("\x03" "4red\x03 plain");
+    QTest::newRow("color two digits") << QString("\x03" "04red \x03" "12blue");
+    QTest::newRow("color background") << QString("\x03" "4,1red on black\x03 plain");
+    QTest::newRow("color comma") << QString("\x03" "4, not a background");
+    QTest::newRow("color digits") << QString("\x03" "0423 is red text");
+    QTest::newRow("reset") << QString("\x02\x1d\x03" "4all\x0f none");
+    QTest::newRow("nested") << QString("\x02" "bold \x03" "4bold red \x1d" "bold red italic\x02 red italic\x03 italic");
+    QTest::newRow("unterminated") << QString("\x02" "bold \x03" "3green \x1f" "underlined");
+    QTest::newRow("empty codes") << QString("\x02\x02\x03\x03 text\x0f");
+    QTest::newRow("escaping") << QString("<b>&amp; \"quoted\" a < b > c & d</b>");
+    QTest::newRow("spaces") << QString("a  b   c    end");
+    QTest::newRow("nick in color") << QString("\x03" "4jpnurmi\x03: hi nick");
+    QTest::newRow("channel in bold") << QString("\x02#communi\x02 and #qt");
+    QTest::newRow("url") << QString("\x02see\x02 http://communi.github.io/?a=1&b=2 jpnurmi");
+    QTest::newRow("www") << QString("go www.example.com/path.");
+    QTest::newRow("email") << QString("\x03" "4mail jpnurmi@example.com");
+    QTest::newRow("addressed") << QString("@jpnurmi <nick> \x02@\x02Guest42");
+}
+
+void tst_MessageFormatter::fastPath()
+{
+    // the previous path: a text format set on the formatter is parsed by
+    // IrcTextFormat, and nicks are linked in a second pass over its html
+    QFETCH(QString, text);
+
+    MessageFormatter formatter;
+    formatter.setNames(names);
+
+    MessageFormatter previous;
+    IrcTextFormat* format = new IrcTextFormat(&previous);
+    format->setSpanFormat(IrcTextFormat::SpanClass);
+    previous.setTextFormat(format);
+    previous.setNames(names);
+
+    QCOMPARE(normalize(formatter.formatText(text)), normalize(previous.formatText(text)));
+    QCOMPARE(normalize(MessageFormatter::formatText(text, names)), normalize(previous.formatText(text)));
+}
+
+QTEST_MAIN(tst_MessageFormatter)
+
+#include "tst_messageformatter.moc"
@@ -0,0 +1,8 @@
+######################################################################
+# Communi
+######################################################################
+
+TEMPLATE = subdirs
+SUBDIRS += messagetemplate
+SUBDIRS += textdocument
+SUBDIRS += textformat
@@ -0,0 +1,11 @@
+######################################################################
+# Communi
+######################################################################
+
+TEMPLATE = app
+TARGET = tst_messagetemplate
+CONFIG += communi communi_base testcase
+COMMUNI += core model util
+QT += testlib concurrent
+
+SOURCES += $$PWD/tst_messagetemplate.cpp
@@ -0,0 +1,153 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <QtTest/QtTest>
+#include <QtConcurrent>
+#include <IrcBufferModel>
+#include <IrcConnection>
+#include <IrcMessage>
+#include <IrcBuffer>
+#include "messagetemplate.h"
+#include "messageformatter.h"
+#include "eventformatter.h"
+
+class tst_MessageTemplate : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void arg();
+    void format();
+    void formatContexts();
+    void formatThreads();
+
+    void formatMessage_data();
+    void formatMessage();
+};
+
+static const char* const Source = "%1 has joined %2";
+static const int Iterations = 1000;
+
+static void formatMany(int count)
+{
+    for (int i = 0; i < count; ++i)
+        MessageTemplate::format("EventFormatter", Source, "jpnurmi", "#communi");
+}
+
+void tst_MessageTemplate::arg()
+{
+    // the translate().arg() chain the templates replace
+    QBENCHMARK {
+        for (int i = 0; i < Iterations; ++i)
+            QCoreApplication::translate("EventFormatter", Source).arg("jpnurmi", "#communi");
+    }
+}
+
+void tst_MessageTemplate::format()
+{
+    QCOMPARE(MessageTemplate::format("EventFormatter", Source, "jpnurmi", "#communi"), QString("jpnurmi has joined #communi"));
+    QBENCHMARK {
+        formatMany(Iterations);
+    }
+}
+
+void tst_MessageTemplate::formatContexts()
+{
+    QBENCHMARK {
+        for (int i = 0; i < Iterations; ++i) {
+            MessageTemplate::format("EventFormatter", Source, "jpnurmi", "#communi");
+            MessageTemplate::format("MessageFormatter", Source, "jpnurmi", "#communi");
+        }
+    }
+}
+
+void tst_MessageTemplate::formatThreads()
+{
+    // formatters run on the worker threads of the text documents too
+    QVector<int> counts(QThread::idealThreadCount(), Iterations);
+    QBENCHMARK {
+        QtConcurrent::blockingMap(counts, formatMany);
+    }
+}
+
+void tst_MessageTemplate::formatMessage_data()
+{
+    QTest::addColumn<QByteArray>("data");
+    QTest::addColumn<bool>("events");
+    QTest::addColumn<bool>("cached");
+
+    const QByteArray privmsg(":jpnurmi!jpnurmi@communi/jpnurmi PRIVMSG #communi :nick42: the fix is in, see #qt for the rest");
+    const QByteArray join(":Guest42!~guest@192.0.2.1 JOIN #communi");
+    const QByteArray quit(":Guest42!~guest@192.0.2.1 QUIT :Ping timeout: 240 seconds");
+
+    // without the cache every message translates and compiles its
+    // templates again, like the translate().arg() chains used to
+    QTest::newRow("MessageFormatter PRIVMSG") << privmsg << false << true;
+    QTest::newRow("MessageFormatter PRIVMSG uncached") << privmsg << false << false;
+    QTest::newRow("MessageFormatter JOIN") << join << false << true;
+    QTest::newRow("MessageFormatter JOIN uncached") << join << false << false;
+    QTest::newRow("MessageFormatter QUIT") << quit << false << true;
+    QTest::newRow("MessageFormatter QUIT uncached") << quit << false << false;
+    QTest::newRow("EventFormatter JOIN") << join << true << true;
+    QTest::newRow("EventFormatter JOIN uncached") << join << true << false;
+    QTest::newRow("EventFormatter QUIT") << quit << true << true;
+    QTest::newRow("EventFormatter QUIT uncached") << quit << true << false;
+}
+
+void tst_MessageTemplate::formatMessage()
+{
+    QFETCH(QByteArray, data);
+    QFETCH(bool, events);
+    QFETCH(bool, cached);
+
+    IrcConnection connection;
+    connection.setNickName("communi");
+    IrcBufferModel model(&connection);
+    IrcBuffer* buffer = model.add("#communi");
+
+    MessageFormatter* formatter = events ? new EventFormatter(this) : new MessageFormatter(this);
+    formatter->setBuffer(buffer);
+
+    IrcMessage* message = IrcMessage::fromData(data, &connection);
+    QVERIFY(message);
+
+    QBENCHMARK {
+        for (int i = 0; i < Iterations; ++i) {
+            if (!cached)
+                MessageTemplate::clearCache();
+            formatter->formatMessage(message);
+        }
+    }
+
+    delete message;
+    delete formatter;
+}
+
+QTEST_MAIN(tst_MessageTemplate)
+
+#include "tst_messagetemplate.moc"
@@ -0,0 +1,110 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <QtTest/QtTest>
+#include <QAbstractTextDocumentLayout>
+#include <IrcBufferModel>
+#include <IrcConnection>
+#include <IrcBuffer>
+#include <QTextBlock>
+#include "textdocument.h"
+#include "messagedata.h"
+
+class tst_TextDocument : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void memoryUsage_data();
+    void memoryUsage();
+};
+
+enum State { Shown, Hidden, Released };
+Q_DECLARE_METATYPE(State)
+
+void tst_TextDocument::memoryUsage_data()
+{
+    QTest::addColumn<int>("lines");
+    QTest::addColumn<int>("length");
+    QTest::addColumn<State>("state");
+
+    const int sizes[][2] = { { 100, 40 }, { 1000, 40 }, { 1000, 400 } };
+    for (int i = 0; i < 3; ++i) {
+        const int lines = sizes[i][0];
+        const int length = sizes[i][1];
+        const QByteArray name = QByteArray::number(lines) + " x " + QByteArray::number(length);
+        QTest::newRow((name + " shown").constData()) << lines << length << Shown;
+        QTest::newRow((name + " hidden").constData()) << lines << length << Hidden;
+        QTest::newRow((name + " released").constData()) << lines << length << Released;
+    }
+}
+
+void tst_TextDocument::memoryUsage()
+{
+    // the memoryUsage() total of one document, after it has been laid out
+    // and shown, then hidden, then released
+    QFETCH(int, lines);
+    QFETCH(int, length);
+    QFETCH(State, state);
+
+    IrcConnection connection;
+    connection.setNickName("communi");
+    IrcBufferModel model(&connection);
+    IrcBuffer* buffer = model.add("#communi");
+
+    TextDocument* doc = new TextDocument(buffer);
+    const QString text(length, 'x');
+    for (int i = 0; i < lines; ++i) {
+        MessageData data;
+        data.setFormat(QString("<span class='message'>%1 %2</span>").arg(i).arg(text));
+        doc->append(data);
+    }
+
+    doc->relayout(QFont(), 600);
+    doc->setVisible(true);
+    doc->setTextWidth(600);
+    QAbstractTextDocumentLayout* layout = doc->documentLayout();
+    for (QTextBlock block = doc->begin(); block.isValid(); block = block.next())
+        layout->blockBoundingRect(block);
+    QCOMPARE(doc->blockCount(), lines);
+
+    if (state != Shown)
+        doc->setVisible(false);
+    if (state == Released) {
+        doc->release();
+        QVERIFY(doc->isReleased());
+    }
+
+    const QVariantMap usage = doc->memoryUsage();
+    QTest::setBenchmarkResult(usage.value("totalBytes").toLongLong(), QTest::BytesAllocated);
+    delete doc;
+}
+
+QTEST_MAIN(tst_TextDocument)
+
+#include "tst_textdocument.moc"
@@ -0,0 +1,11 @@
+######################################################################
+# Communi
+######################################################################
+
+TEMPLATE = app
+TARGET = tst_textformat
+CONFIG += communi communi_base testcase
+COMMUNI += core model util
+QT += testlib
+
+SOURCES += $$PWD/tst_textformat.cpp
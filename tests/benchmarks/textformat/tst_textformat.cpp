@@ -0,0 +1,104 @@
+/*
+  Copyright (C) 2008-2016 The Communi Project
+
+  You may use this file under the terms of BSD license as follows:
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <QtTest/QtTest>
+#include <IrcTextFormat>
+#include "messageformatter.h"
+#include "nickmatcher.h"
+
+// replays the content of a channel log written by the logger plugin,
+// "[yyyy-MM-dd] hh:mm:ss nick: content" per line
+class tst_TextFormat : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+
+    void ircTextFormat();
+    void formatText();
+
+private:
+    QStringList lines;
+    NickMatcher names;
+};
+
+void tst_TextFormat::initTestCase()
+{
+    const QString path = QString::fromLocal8Bit(qgetenv("COMMUNI_BENCHMARK_LOG"));
+    if (path.isEmpty())
+        QSKIP("Set COMMUNI_BENCHMARK_LOG to a channel log written by the logger plugin");
+
+    QFile file(path);
+    QVERIFY2(file.open(QIODevice::ReadOnly | QIODevice::Text), qPrintable(file.errorString()));
+
+    QTextStream in(&file);
+    in.setCodec("UTF-8");
+    QStringList nicks;
+    QRegExp rx("^\\[\\d{4}-\\d{2}-\\d{2}\\] \\d{2}:\\d{2}:\\d{2} ([^ :]+): (.*)$");
+    while (!in.atEnd()) {
+        if (rx.exactMatch(in.readLine())) {
+            nicks += rx.cap(1);
+            lines += rx.cap(2);
+        }
+    }
+    QVERIFY2(!lines.isEmpty(), "The log contains no messages");
+
+    nicks.removeDuplicates();
+    names.setNicks(nicks);
+    qDebug("%d lines by %d nicks", lines.count(), nicks.count());
+}
+
+void tst_TextFormat::ircTextFormat()
+{
+    // the previous path: a text format set on the formatter is parsed by
+    // IrcTextFormat, and nicks are linked in a second pass over its html
+    MessageFormatter formatter;
+    IrcTextFormat* format = new IrcTextFormat(&formatter);
+    format->setSpanFormat(IrcTextFormat::SpanClass);
+    formatter.setTextFormat(format);
+    formatter.setNames(names);
+    QBENCHMARK {
+        foreach (const QString& line, lines)
+            formatter.formatText(line);
+    }
+}
+
+void tst_TextFormat::formatText()
+{
+    MessageFormatter formatter;
+    formatter.setNames(names);
+    QBENCHMARK {
+        foreach (const QString& line, lines)
+            formatter.formatText(line);
+    }
+}
+
+QTEST_MAIN(tst_TextFormat)
+
+#include "tst_textformat.moc"
@@ -0,0 +1,7 @@
+######################################################################
+# Communi
+######################################################################
+
+TEMPLATE = subdirs
+SUBDIRS += auto
+SUBDIRS += benchmarks